@@ -0,0 +1,813 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <endian.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+/* Global variables */
+#define BUFFER_SIZE 100
+#define RECEIVE_BUFFER_SIZE (256 * 1024)                                        /* Size of the buffer the file contents are received into */
+#define PROTOCOL_VERSION 2
+#define FRAME_HEADER_SIZE 16                                                    /* version, opcode, flags, length and value of a version 2 frame */
+#define MAX_PAYLOAD_SIZE 4096
+
+enum frameOpcode { OP_HELLO = 1, OP_LIST, OP_GET, OP_OK, OP_ERROR, OP_ENTRY, OP_FILE, OP_END, OP_STAT };
+
+enum requestFlag { FLAG_SINGLE_CONNECTION = 0x0001, FLAG_RANGE = 0x0002, FLAG_CHECKSUM = 0x0020 };
+
+#define TINY_PREFIX "bench-tiny-"                                               /* Names of the files generated for the load test */
+#define HUGE_PREFIX "bench-huge-"
+
+int requestFlags = 0;                                                           /* Extra flags sent with every get request, set with the -c option */
+
+struct loadTest {                                                               /* Settings of the load test, started with the -C option */
+    char *hostName;
+    char *serverPort;
+    int connections;
+    double seconds;
+    int listPercent;                                                            /* Share of the requests that list the directory */
+    int hugePercent;                                                            /* Share of the get requests that fetch a huge file instead of a tiny one */
+    int tinyCount;
+    long long tinySize;
+    int hugeCount;
+    long long hugeSize;
+    double stopAt;                                                              /* Time at which the connections stop sending requests */
+};
+
+struct loadTest loadTest = { NULL, NULL, 0, 10, 5, 1, 1000, 4096, 2, 64 << 20, 0 };
+
+struct loadClient {                                                             /* One connection of the load test, run by its own thread */
+    pthread_t thread;
+    unsigned int seed;
+    long long lists;
+    long long gets;
+    long long errors;
+    long long bytes;                                                            /* File contents received */
+    long long *latencies;                                                       /* Time taken by each request, in nanoseconds */
+    size_t latencyCount;
+    size_t latencyCapacity;
+};
+
+struct stream {                                                                 /* One range of the file, received by its own thread over its own connection */
+    char *hostName;
+    char *serverPort;
+    char *fileName;
+    uint64_t offset;
+    uint64_t length;
+    long long received;
+    pthread_t thread;
+};
+
+void error(const char *msg){                                                    /* Error function used for reporting issues */
+    perror(msg);
+    exit(1);
+}
+
+/****************************************************************
+* Name: currentTime()
+* Description: This function returns the current time of the monotonic clock in seconds.
+* Resources used: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+****************************************************************/
+double currentTime(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/****************************************************************
+* Name: connectToServer()
+* Description: This function receives the server host name and port number as arguments and opens the TCP control connection to
+*               the server. This function will return the socket file descriptor.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+****************************************************************/
+int connectToServer(char *hostName, char *portNum){
+    struct addrinfo hints;
+    struct addrinfo *result;
+    int socketFD;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(hostName, portNum, &hints, &result) != 0){
+        error("Error in getting address.\n");
+    }
+
+    socketFD = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(socketFD == -1){
+        error("Error in creating socket.\n");
+    }
+
+    if(connect(socketFD, result->ai_addr, result->ai_addrlen) == -1){
+        error("Error connecting.\n");
+    }
+
+    freeaddrinfo(result);
+
+    return socketFD;
+}
+
+/****************************************************************
+* Name: createDataListener()
+* Description: This function creates the socket that the server opens the TCP data connection to. It is bound to a port chosen by the
+*               kernel, which is stored in portNum so that it can be sent to the server. This function will return the socket file
+*               descriptor.
+****************************************************************/
+int createDataListener(char *portNum){
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(socketFD == -1){
+        error("Error in creating socket.\n");
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = 0;
+
+    if(bind(socketFD, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(socketFD, 1) == -1){
+        error("Error in binding data socket.\n");
+    }
+
+    getsockname(socketFD, (struct sockaddr *)&address, &length);
+    snprintf(portNum, BUFFER_SIZE, "%d", ntohs(address.sin_port));
+
+    return socketFD;
+}
+
+/****************************************************************
+* Name: exchange()
+* Description: This function receives the TCP control connection, a message and a buffer as arguments. It sends the message to the
+*               server and waits for its reply, which is stored in the buffer.
+****************************************************************/
+void exchange(int socketFD, const char *msg, char *reply){
+    ssize_t charsRead;
+
+    if(send(socketFD, msg, strlen(msg), 0) == -1){
+        error("ERROR writing to socket");
+    }
+
+    memset(reply, 0, BUFFER_SIZE);
+    charsRead = recv(socketFD, reply, BUFFER_SIZE - 1, 0);
+    if(charsRead <= 0){
+        error("ERROR reading from socket");
+    }
+}
+
+/****************************************************************
+* Name: getFile()
+* Description: This function receives the server host name, the server port number and a file name as arguments. It requests the
+*               file the same way client.py does with "-g", receives the contents over the TCP data connection and discards them.
+*               This function will return the number of bytes of file contents received.
+****************************************************************/
+long long getFile(char *hostName, char *serverPort, char *fileName){
+    char portNum[BUFFER_SIZE];
+    char localIP[INET_ADDRSTRLEN];
+    char reply[BUFFER_SIZE];
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    long long received = 0;
+    int listenFD = createDataListener(portNum);                                 /* Listen before the request is sent, so the server never has to wait for it */
+    int controlFD = connectToServer(hostName, serverPort);
+    int dataFD;
+    ssize_t charsRead;
+
+    if(buffer == NULL){
+        error("Error allocating buffer.\n");
+    }
+
+    getsockname(controlFD, (struct sockaddr *)&local, &length);                 /* The server connects back to the address this connection came from */
+    inet_ntop(AF_INET, &local.sin_addr, localIP, sizeof(localIP));
+
+    exchange(controlFD, portNum, reply);
+    exchange(controlFD, "g", reply);
+    exchange(controlFD, localIP, reply);
+    if(strcmp(reply, "NCE") != 0){
+        error("Server rejected the command.\n");
+    }
+    exchange(controlFD, fileName, reply);
+    if(strcmp(reply, "NFE") != 0){
+        fprintf(stderr, "%s: %s says FILE NOT FOUND\n", hostName, serverPort);
+        exit(1);
+    }
+
+    dataFD = accept(listenFD, NULL, NULL);
+    if(dataFD == -1){
+        error("Error accepting data connection.\n");
+    }
+
+    while((charsRead = recv(dataFD, buffer, RECEIVE_BUFFER_SIZE, 0)) > 0){
+        received += charsRead;
+    }
+
+    close(dataFD);
+    close(controlFD);
+    close(listenFD);
+    free(buffer);
+
+    return received - 3;                                                        /* Do not count the "EOF" marker */
+}
+
+/****************************************************************
+* Name: sendFrame()
+* Description: This function receives a socket, an opcode, flags, a value and a payload as arguments and sends them as a version 2
+*               frame.
+****************************************************************/
+void sendFrame(int socketFD, int opcode, int flags, uint64_t value, const char *payload, size_t length){
+    char frame[FRAME_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+    uint16_t flagBytes = htons(flags);
+    uint32_t lengthBytes = htonl(length);
+    uint64_t valueBytes = htobe64(value);
+
+    frame[0] = PROTOCOL_VERSION;
+    frame[1] = opcode;
+    memcpy(frame + 2, &flagBytes, sizeof(flagBytes));
+    memcpy(frame + 4, &lengthBytes, sizeof(lengthBytes));
+    memcpy(frame + 8, &valueBytes, sizeof(valueBytes));
+    if(length > 0){
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    }
+
+    if(send(socketFD, frame, FRAME_HEADER_SIZE + length, 0) == -1){
+        error("ERROR writing to socket");
+    }
+}
+
+/****************************************************************
+* Name: recvExactly()
+* Description: This function receives a socket, a buffer and a length as arguments and reads exactly that many bytes into the buffer.
+****************************************************************/
+void recvExactly(int socketFD, char *buffer, size_t length){
+    while(length > 0){
+        ssize_t charsRead = recv(socketFD, buffer, length, 0);
+
+        if(charsRead <= 0){
+            error("ERROR reading from socket");
+        }
+        buffer += charsRead;
+        length -= charsRead;
+    }
+}
+
+/****************************************************************
+* Name: recvFrame()
+* Description: This function receives a socket and a buffer of MAX_PAYLOAD_SIZE bytes as arguments and reads the next version 2
+*               frame, whose payload is stored in the buffer. This function will return the opcode and store the value in value.
+****************************************************************/
+int recvFrame(int socketFD, uint64_t *value, char *payload){
+    char header[FRAME_HEADER_SIZE];
+    uint32_t length;
+
+    recvExactly(socketFD, header, FRAME_HEADER_SIZE);
+    memcpy(&length, header + 4, sizeof(length));
+    memcpy(value, header + 8, sizeof(*value));
+    length = ntohl(length);
+    *value = be64toh(*value);
+
+    if(header[0] != PROTOCOL_VERSION || length > MAX_PAYLOAD_SIZE){
+        error("Unexpected reply from server.\n");
+    }
+    recvExactly(socketFD, payload, length);
+
+    return header[1];
+}
+
+/****************************************************************
+* Name: openSession()
+* Description: This function receives the server host name and port number as arguments, opens a TCP control connection and starts a
+*               version 2 session on it. This function will return the socket file descriptor.
+****************************************************************/
+int openSession(char *hostName, char *serverPort){
+    char payload[MAX_PAYLOAD_SIZE];
+    uint64_t value;
+    int socketFD = connectToServer(hostName, serverPort);
+
+    sendFrame(socketFD, OP_HELLO, 0, PROTOCOL_VERSION, NULL, 0);
+    if(recvFrame(socketFD, &value, payload) != OP_HELLO){
+        error("Server does not support protocol version 2.\n");
+    }
+
+    return socketFD;
+}
+
+/****************************************************************
+* Name: sendGet()
+* Description: This function receives a TCP control connection, an opcode, a file name and a byte range as arguments and sends a
+*               single-connection request for the file, with the range flag if the range has a length.
+****************************************************************/
+void sendGet(int socketFD, int opcode, char *fileName, uint64_t offset, uint64_t length){
+    char payload[MAX_PAYLOAD_SIZE];
+    size_t nameLength = strlen(fileName);
+    size_t payloadLength = 4;
+    uint64_t rangeBytes;
+
+    if(nameLength > MAX_PAYLOAD_SIZE - 20){
+        error("File name is too long.\n");
+    }
+
+    memset(payload, 0, 4);                                                      /* No data port or host name in single-connection mode */
+    if(length != 0){
+        rangeBytes = htobe64(offset);
+        memcpy(payload + payloadLength, &rangeBytes, sizeof(rangeBytes));
+        rangeBytes = htobe64(length);
+        memcpy(payload + payloadLength + sizeof(rangeBytes), &rangeBytes, sizeof(rangeBytes));
+        payloadLength += 2 * sizeof(rangeBytes);
+    }
+    memcpy(payload + payloadLength, fileName, nameLength);
+
+    sendFrame(socketFD, opcode, FLAG_SINGLE_CONNECTION | (length != 0 ? FLAG_RANGE : 0) | (opcode == OP_GET ? requestFlags : 0), 0, payload, payloadLength + nameLength);
+}
+
+/****************************************************************
+* Name: receiveStream()
+* Description: This function is the entry point of each stream's thread. It opens its own version 2 session, requests its range of the
+*               file over the TCP control connection, receives the contents and discards them.
+****************************************************************/
+void *receiveStream(void *arg){
+    struct stream *range = arg;
+    char payload[MAX_PAYLOAD_SIZE];
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    uint64_t remaining;
+    int socketFD = openSession(range->hostName, range->serverPort);
+
+    if(buffer == NULL){
+        error("Error allocating buffer.\n");
+    }
+
+    sendGet(socketFD, OP_GET, range->fileName, range->offset, range->length);
+    if(recvFrame(socketFD, &remaining, payload) != OP_OK || recvFrame(socketFD, &remaining, payload) != OP_FILE){
+        error("Server rejected the request.\n");
+    }
+
+    while(remaining > 0){
+        ssize_t charsRead = recv(socketFD, buffer, remaining < RECEIVE_BUFFER_SIZE ? remaining : RECEIVE_BUFFER_SIZE, 0);
+
+        if(charsRead <= 0){
+            error("ERROR reading from socket");
+        }
+        range->received += charsRead;
+        remaining -= charsRead;
+    }
+    recvFrame(socketFD, &remaining, payload);                                   /* The end frame */
+
+    close(socketFD);
+    free(buffer);
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: getFileStreams()
+* Description: This function receives the server host name, the server port number, a file name and a number of streams as arguments.
+*               It asks the server for the size of the file, splits the file into that many ranges and receives them at the same
+*               time, each over its own connection, the same way client.py does with "--streams". This function will return the
+*               number of bytes of file contents received.
+****************************************************************/
+long long getFileStreams(char *hostName, char *serverPort, char *fileName, int streamCount){
+    struct stream *streams = calloc(streamCount, sizeof(struct stream));
+    char payload[MAX_PAYLOAD_SIZE];
+    uint64_t fileSize;
+    uint64_t rangeSize;
+    long long received = 0;
+    int socketFD = openSession(hostName, serverPort);
+    int i = 0;
+
+    if(streams == NULL){
+        error("Error allocating streams.\n");
+    }
+
+    sendGet(socketFD, OP_STAT, fileName, 0, 0);
+    if(recvFrame(socketFD, &fileSize, payload) != OP_OK){
+        fprintf(stderr, "%s: %s says FILE NOT FOUND\n", hostName, serverPort);
+        exit(1);
+    }
+    close(socketFD);
+
+    rangeSize = (fileSize + streamCount - 1) / streamCount;
+    for(i = 0; i < streamCount; i++){
+        streams[i].hostName = hostName;
+        streams[i].serverPort = serverPort;
+        streams[i].fileName = fileName;
+        streams[i].offset = i * rangeSize < fileSize ? i * rangeSize : fileSize;
+        streams[i].length = fileSize - streams[i].offset < rangeSize ? fileSize - streams[i].offset : rangeSize;
+        if(streams[i].length != 0 && pthread_create(&streams[i].thread, NULL, receiveStream, &streams[i]) != 0){
+            error("Error creating stream thread.\n");
+        }
+    }
+
+    for(i = 0; i < streamCount; i++){
+        if(streams[i].length != 0){
+            pthread_join(streams[i].thread, NULL);
+        }
+        received += streams[i].received;
+    }
+    free(streams);
+
+    return received;
+}
+
+/****************************************************************
+* Name: generateFiles()
+* Description: This function receives the directory the server serves as an argument and generates the file set of the load test in
+*               it: tinyCount files of tinySize bytes and hugeCount files of hugeSize bytes, filled with random bytes so that they do
+*               not compress. Files that already have the right size are kept, so the file set is only written once. This function
+*               then waits until the server's directory index holds the last of them.
+****************************************************************/
+void generateFiles(char *directory){
+    char path[PATH_MAX];
+    char payload[MAX_PAYLOAD_SIZE];
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    unsigned int seed = 1;
+    uint64_t value;
+    int socketFD;
+    int i = 0;
+
+    if(buffer == NULL){
+        error("Error allocating buffer.\n");
+    }
+
+    for(i = 0; i < loadTest.tinyCount + loadTest.hugeCount; i++){
+        int tiny = i < loadTest.tinyCount;
+        long long size = tiny ? loadTest.tinySize : loadTest.hugeSize;
+        long long written = 0;
+        struct stat fileStat;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s%d", directory, tiny ? TINY_PREFIX : HUGE_PREFIX, tiny ? i : i - loadTest.tinyCount);
+        if(stat(path, &fileStat) == 0 && fileStat.st_size == size){
+            continue;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1){
+            error("Error creating test file.\n");
+        }
+        while(written < size){
+            ssize_t chunk;
+            int j = 0;
+
+            for(j = 0; j < RECEIVE_BUFFER_SIZE; j++){                           /* Fresh random bytes for every chunk, so that no part of the file compresses */
+                buffer[j] = rand_r(&seed);
+            }
+            chunk = write(fd, buffer, size - written < RECEIVE_BUFFER_SIZE ? size - written : RECEIVE_BUFFER_SIZE);
+            if(chunk <= 0){
+                error("Error writing test file.\n");
+            }
+            written += chunk;
+        }
+        close(fd);
+    }
+    free(buffer);
+    if(loadTest.tinyCount + loadTest.hugeCount == 0){
+        return;
+    }
+
+    socketFD = openSession(loadTest.hostName, loadTest.serverPort);
+    snprintf(path, sizeof(path), "%s%d", loadTest.hugeCount > 0 ? HUGE_PREFIX : TINY_PREFIX, (loadTest.hugeCount > 0 ? loadTest.hugeCount : loadTest.tinyCount) - 1);
+    for(i = 0; i < 100; i++){                                                   /* The server picks up new files through inotify */
+        sendGet(socketFD, OP_STAT, path, 0, 0);
+        if(recvFrame(socketFD, &value, payload) == OP_OK){
+            break;
+        }
+        usleep(50000);
+    }
+    close(socketFD);
+}
+
+/****************************************************************
+* Name: recordLatency()
+* Description: This function receives a load test connection and the time one of its requests took as arguments and keeps the time.
+****************************************************************/
+void recordLatency(struct loadClient *client, long long nanoseconds){
+    if(client->latencyCount == client->latencyCapacity){
+        client->latencyCapacity = client->latencyCapacity ? 2 * client->latencyCapacity : 4096;
+        client->latencies = realloc(client->latencies, client->latencyCapacity * sizeof(long long));
+        if(client->latencies == NULL){
+            error("Error allocating latencies.\n");
+        }
+    }
+    client->latencies[client->latencyCount++] = nanoseconds;
+}
+
+/****************************************************************
+* Name: runLoadClient()
+* Description: This function is the entry point of each load test connection. It opens a version 2 session and sends requests over it
+*               back to back, in single-connection mode, until the test ends: a listing of the directory for listPercent of them, and
+*               otherwise a get of a random tiny file or, for hugePercent of the gets, a random huge file. The file contents are
+*               received and discarded, and the time each request took is recorded.
+****************************************************************/
+void *runLoadClient(void *arg){
+    struct loadClient *client = arg;
+    char payload[MAX_PAYLOAD_SIZE];
+    char fileName[BUFFER_SIZE];
+    char *buffer = malloc(RECEIVE_BUFFER_SIZE);
+    int socketFD = openSession(loadTest.hostName, loadTest.serverPort);
+
+    if(buffer == NULL){
+        error("Error allocating buffer.\n");
+    }
+
+    while(currentTime() < loadTest.stopAt){
+        double start = currentTime();
+        uint64_t remaining;
+
+        if((int)(rand_r(&client->seed) % 100) < loadTest.listPercent){
+            sendGet(socketFD, OP_LIST, "", 0, 0);
+            if(recvFrame(socketFD, &remaining, payload) != OP_OK){
+                client->errors++;
+                continue;
+            }
+            while(recvFrame(socketFD, &remaining, payload) == OP_ENTRY){        /* Until the end frame */
+            }
+            client->lists++;
+        }
+        else{
+            if(loadTest.hugeCount > 0 && (loadTest.tinyCount == 0 || (int)(rand_r(&client->seed) % 100) < loadTest.hugePercent)){
+                snprintf(fileName, sizeof(fileName), "%s%d", HUGE_PREFIX, (int)(rand_r(&client->seed) % loadTest.hugeCount));
+            }
+            else{
+                snprintf(fileName, sizeof(fileName), "%s%d", TINY_PREFIX, (int)(rand_r(&client->seed) % loadTest.tinyCount));
+            }
+
+            sendGet(socketFD, OP_GET, fileName, 0, 0);
+            if(recvFrame(socketFD, &remaining, payload) != OP_OK){
+                client->errors++;
+                continue;
+            }
+            if(recvFrame(socketFD, &remaining, payload) != OP_FILE){
+                error("Unexpected reply from server.\n");
+            }
+            while(remaining > 0){
+                ssize_t charsRead = recv(socketFD, buffer, remaining < RECEIVE_BUFFER_SIZE ? remaining : RECEIVE_BUFFER_SIZE, 0);
+
+                if(charsRead <= 0){
+                    error("ERROR reading from socket");
+                }
+                client->bytes += charsRead;
+                remaining -= charsRead;
+            }
+            recvFrame(socketFD, &remaining, payload);                           /* The end frame */
+            client->gets++;
+        }
+
+        recordLatency(client, (long long)((currentTime() - start) * 1e9));
+    }
+
+    close(socketFD);
+    free(buffer);
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: readServerCPU()
+* Description: This function receives the process ID of the server as an argument and returns the CPU time, user and system, that the
+*               server has used so far in seconds, or -1 if it cannot be read.
+* Resources used: http://man7.org/linux/man-pages/man5/proc.5.html
+****************************************************************/
+double readServerCPU(int pid){
+    char path[BUFFER_SIZE];
+    char line[1024];
+    char *fields;
+    unsigned long long userTicks = 0;
+    unsigned long long systemTicks = 0;
+    FILE *statFile;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    statFile = fopen(path, "r");
+    if(statFile == NULL){
+        return -1;
+    }
+    fields = fgets(line, sizeof(line), statFile);
+    fclose(statFile);
+
+    fields = fields != NULL ? strrchr(line, ')') : NULL;                        /* The process name may hold spaces, so skip past it */
+    if(fields == NULL || sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &userTicks, &systemTicks) != 2){
+        return -1;
+    }
+
+    return (userTicks + systemTicks) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/****************************************************************
+* Name: compareLatencies()
+* Description: This function compares two request times for qsort().
+****************************************************************/
+int compareLatencies(const void *first, const void *second){
+    long long difference = *(const long long *)first - *(const long long *)second;
+
+    return (difference > 0) - (difference < 0);
+}
+
+/****************************************************************
+* Name: runLoadTest()
+* Description: This function receives the process ID of the server (0 if it is not known) and whether to print JSON as arguments. It
+*               runs the load test with one thread per connection for the configured time, then reports the requests per second, the
+*               throughput, the 50th, 99th and 99.9th percentile of the request times and, if the server's process ID is known, the
+*               CPU time the server used per GB sent. The JSON output is a single line, so that results can be collected across builds.
+****************************************************************/
+void runLoadTest(int pid, int json){
+    struct loadClient *clients = calloc(loadTest.connections, sizeof(struct loadClient));
+    struct loadClient total;
+    long long *latencies;
+    double cpuStart = pid > 0 ? readServerCPU(pid) : -1;
+    double cpuSeconds = -1;
+    double start = currentTime();
+    double seconds;
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    size_t merged = 0;
+    int i = 0;
+
+    if(clients == NULL){
+        error("Error allocating connections.\n");
+    }
+
+    loadTest.stopAt = start + loadTest.seconds;
+    for(i = 0; i < loadTest.connections; i++){
+        clients[i].seed = i + 1;
+        if(pthread_create(&clients[i].thread, NULL, runLoadClient, &clients[i]) != 0){
+            error("Error creating connection thread.\n");
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < loadTest.connections; i++){
+        pthread_join(clients[i].thread, NULL);
+        total.lists += clients[i].lists;
+        total.gets += clients[i].gets;
+        total.errors += clients[i].errors;
+        total.bytes += clients[i].bytes;
+        total.latencyCount += clients[i].latencyCount;
+    }
+    seconds = currentTime() - start;
+    if(cpuStart >= 0 && readServerCPU(pid) >= 0){
+        cpuSeconds = readServerCPU(pid) - cpuStart;
+    }
+
+    latencies = malloc((total.latencyCount + 1) * sizeof(long long));           /* Merge the request times of every connection */
+    if(latencies == NULL){
+        error("Error allocating latencies.\n");
+    }
+    for(i = 0; i < loadTest.connections; i++){
+        if(clients[i].latencyCount > 0){
+            memcpy(latencies + merged, clients[i].latencies, clients[i].latencyCount * sizeof(long long));
+        }
+        merged += clients[i].latencyCount;
+        free(clients[i].latencies);
+    }
+    if(merged > 0){
+        qsort(latencies, merged, sizeof(long long), compareLatencies);
+        p50 = latencies[merged * 50 / 100] / 1e6;
+        p99 = latencies[merged * 99 / 100] / 1e6;
+        p999 = latencies[merged * 999 / 1000] / 1e6;
+    }
+
+    if(json){
+        printf("{\"connections\": %d, \"seconds\": %.3f, \"list_percent\": %d, \"huge_percent\": %d, \"requests\": %lld, \"lists\": %lld, \"gets\": %lld, \"errors\": %lld, ",
+               loadTest.connections, seconds, loadTest.listPercent, loadTest.hugePercent, total.lists + total.gets, total.lists, total.gets, total.errors);
+        printf("\"requests_per_second\": %.1f, \"bytes\": %lld, \"mb_per_second\": %.1f, \"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}, ",
+               (total.lists + total.gets) / seconds, total.bytes, total.bytes / seconds / 1e6, p50, p99, p999);
+        if(cpuSeconds >= 0){
+            printf("\"server_cpu_seconds\": %.2f, \"server_cpu_seconds_per_gb\": %.3f}\n", cpuSeconds, total.bytes > 0 ? cpuSeconds / (total.bytes / 1e9) : 0);
+        }
+        else{
+            printf("\"server_cpu_seconds\": null, \"server_cpu_seconds_per_gb\": null}\n");
+        }
+    }
+    else{
+        printf("load: %d connections for %.1f s, %d%% lists, %d%% of gets for huge files\n", loadTest.connections, seconds, loadTest.listPercent, loadTest.hugePercent);
+        printf("requests: %lld (%lld lists, %lld gets, %lld errors), %.1f requests/s\n", total.lists + total.gets, total.lists, total.gets, total.errors, (total.lists + total.gets) / seconds);
+        printf("throughput: %lld bytes, %.1f MB/s\n", total.bytes, total.bytes / seconds / 1e6);
+        printf("latency: p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n", p50, p99, p999);
+        if(cpuSeconds >= 0){
+            printf("server CPU: %.2f s, %.3f s per GB\n", cpuSeconds, total.bytes > 0 ? cpuSeconds / (total.bytes / 1e9) : 0);
+        }
+    }
+
+    free(latencies);
+    free(clients);
+}
+
+/****************************************************************
+* Name: main()
+* Description: Requests the same file from the server a number of times in a row and reports the time taken and throughput of each
+*               transfer, followed by the average. Run it once against a server started normally and once against a server started
+*               with "-m copy -B 99" to compare sendfile() with the original read()/send() loop. With "-s streams", each transfer is
+*               split into that many ranges received in parallel over version 2 connections, to measure how throughput scales with
+*               the number of streams. With "-c", the server is also asked for the checksum of each range, to measure what
+*               computing it costs the server. With "-C connections", a load test is run instead: that many connections send a mix of
+*               list and get requests against a generated file set of many tiny and a few huge files for "-d seconds".
+****************************************************************/
+int main(int argc, char *argv[]){
+    int iterations = 5;
+    int streamCount = 0;
+    int option = 0;
+    int i = 0;
+    double totalSeconds = 0;
+    long long totalBytes = 0;
+    char *directory = NULL;
+    int serverPID = 0;
+    int json = 0;
+
+    while((option = getopt(argc, argv, "n:s:cC:d:l:h:T:H:G:p:j")) != -1){
+        switch(option){
+            case 'n':
+                iterations = atoi(optarg);                                      /* Number of times the file is requested */
+                break;
+            case 's':
+                streamCount = atoi(optarg);                                     /* Number of parallel streams per transfer, 0 for a single version 1 transfer */
+                break;
+            case 'c':
+                requestFlags |= FLAG_CHECKSUM;                                  /* Ask for checksums, which version 1 transfers do not have */
+                break;
+            case 'C':
+                loadTest.connections = atoi(optarg);                            /* Number of connections of the load test */
+                break;
+            case 'd':
+                loadTest.seconds = atof(optarg);                                /* How long the load test runs */
+                break;
+            case 'l':
+                loadTest.listPercent = atoi(optarg);                            /* Share of the requests that list the directory */
+                break;
+            case 'h':
+                loadTest.hugePercent = atoi(optarg);                            /* Share of the gets that fetch a huge file */
+                break;
+            case 'T':
+                if(sscanf(optarg, "%d:%lld", &loadTest.tinyCount, &loadTest.tinySize) != 2 || loadTest.tinyCount < 0 || loadTest.tinySize < 0){    /* Number and size of the tiny files */
+                    error("Please give the tiny files as count:bytes.\n");
+                }
+                break;
+            case 'H':
+                if(sscanf(optarg, "%d:%lld", &loadTest.hugeCount, &loadTest.hugeSize) != 2 || loadTest.hugeCount < 0 || loadTest.hugeSize < 0){    /* Number and size of the huge files */
+                    error("Please give the huge files as count:bytes.\n");
+                }
+                break;
+            case 'G':
+                directory = optarg;                                             /* Directory the server serves, where the file set is generated */
+                break;
+            case 'p':
+                serverPID = atoi(optarg);                                       /* Process ID of the server, to measure its CPU time */
+                break;
+            case 'j':
+                json = 1;                                                       /* Print the load test results as JSON */
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-s streams] [-c] <server host> <server port #> <file name>\n", argv[0]);
+                fprintf(stderr, "       %s -C connections [-d seconds] [-l list %%] [-h huge %%] [-T tiny count:bytes] [-H huge count:bytes] [-G server directory] [-p server pid] [-j] [-c] <server host> <server port #>\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if(loadTest.connections > 0){
+        if(argc - optind != 2){
+            error("Incorrect number of arguments.\n");
+        }
+        if(loadTest.tinyCount + loadTest.hugeCount == 0 && loadTest.listPercent < 100){
+            error("There are no files to get.\n");
+        }
+        loadTest.hostName = argv[optind];
+        loadTest.serverPort = argv[optind + 1];
+        if(directory != NULL){
+            generateFiles(directory);
+        }
+        runLoadTest(serverPID, json);
+        return 0;
+    }
+
+    if(argc - optind != 3){
+        error("Incorrect number of arguments.\n");
+    }
+
+    for(i = 0; i < iterations; i++){
+        double start = currentTime();
+        long long bytes = streamCount > 0 ? getFileStreams(argv[optind], argv[optind + 1], argv[optind + 2], streamCount) : getFile(argv[optind], argv[optind + 1], argv[optind + 2]);
+        double seconds = currentTime() - start;
+
+        printf("transfer %d: %lld bytes in %.3f s, %.1f MB/s\n", i + 1, bytes, seconds, bytes / seconds / 1e6);
+        totalSeconds += seconds;
+        totalBytes += bytes;
+    }
+
+    printf("average: %.1f MB/s over %d transfers\n", totalBytes / totalSeconds / 1e6, iterations);
+
+    return 0;
+}
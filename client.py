@@ -1,9 +1,137 @@
 #!/bin/python
 
 from socket import *
+import struct
+import os
 import sys
+import threading
+import time
+import zlib
+
+# Version 2 frames start with a fixed header: version (1 byte), opcode (1 byte), flags (2 bytes), payload length (4 bytes) and value (8 bytes), in network byte order
+PROTOCOL_VERSION = 2
+FRAME_HEADER = struct.Struct(">BBHIQ")
+OP_HELLO, OP_LIST, OP_GET, OP_OK, OP_ERROR, OP_ENTRY, OP_FILE, OP_END, OP_STAT, OP_BLOCK, OP_BATCH, OP_STATS, OP_RECORDS, OP_PUT = range(1, 15)
+ERROR_COMMAND, ERROR_FILE, ERROR_REQUEST, ERROR_RANGE, ERROR_UPLOAD = range(1, 6)
+FLAG_SINGLE_CONNECTION = 0x0001
+FLAG_RANGE = 0x0002
+FLAG_ZLIB, FLAG_LZ4, FLAG_ZSTD = 0x0004, 0x0008, 0x0010
+FLAG_CHECKSUM = 0x0020
+FLAG_STREAM, FLAG_DETAILS, FLAG_RECURSIVE = 0x0040, 0x0080, 0x0100
+# A range request and the file frame that answers it hold two 8-byte numbers: the offset, then the length requested or the size of the whole file
+RANGE = struct.Struct(">QQ")
+# A record of a streaming listing holds the length of the path and the type of the entry, then with --details its size and mtime in nanoseconds, then the path
+RECORD = struct.Struct(">HB")
+DETAILS = struct.Struct(">QQ")
+# Letters ls uses for the d_type values the server reports
+TYPES = {1: "p", 2: "c", 4: "d", 6: "b", 8: "-", 10: "l", 12: "s"}
+RECEIVE_SIZE = 65536
+# With --streams, never split a file into ranges smaller than this
+MIN_STREAM_SIZE = 1024 * 1024
+
+# Compressors whose blocks the client can decompress, given the compressed block and its size once decompressed. zlib is always available, zstd and LZ4 only if their modules are installed
+DECOMPRESSORS = {FLAG_ZLIB: lambda block, size: zlib.decompress(block)}
+try:
+    import zstandard
+    DECOMPRESSORS[FLAG_ZSTD] = lambda block, size: zstandard.ZstdDecompressor().decompress(block, max_output_size=size)
+except ImportError:
+    pass
+try:
+    import lz4.block
+    DECOMPRESSORS[FLAG_LZ4] = lambda block, size: lz4.block.decompress(block, uncompressed_size=size)
+except ImportError:
+    pass
+
+# The server sends the CRC32C of the file contents in the end frame. Computing it in pure Python is slow, so the crc32c module is used if it is installed. I utilized: https://www.ietf.org/rfc/rfc3720.txt (Section 12.1)
+def makeChecksumTable():
+    table = []
+    for i in range(256):
+        crc = i
+        for j in range(8):
+            crc = (crc >> 1) ^ 0x82F63B78 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+CHECKSUM_TABLE = makeChecksumTable()
+
+def updateChecksumSoftware(data, checksum=0):
+    crc = checksum ^ 0xFFFFFFFF
+    for byte in bytearray(data):
+        crc = CHECKSUM_TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+try:
+    import crc32c
+    updateChecksum = getattr(crc32c, "crc32c", None) or crc32c.crc32
+    fastChecksum = True
+except ImportError:
+    updateChecksum = updateChecksumSoftware
+    fastChecksum = False
+
+# Options given as --name or --name=value
+options = {}
+
+def verifying():
+    # Checksums are checked by default only when the crc32c module is installed, because the pure-Python version is far slower than the transfer itself. --verify checks them anyway and --no-verify skips them
+    return "verify" in options or (fastChecksum and "no-verify" not in options)
+
+def parseOptions():
+    # Remove the options from sys.argv so that the positional arguments keep their places. I utilized: https://docs.python.org/2/library/stdtypes.html#str.partition
+    for arg in sys.argv[1:]:
+        if arg.startswith("--"):
+            name, _, value = arg[2:].partition("=")
+            options[name] = value
+    sys.argv = [arg for arg in sys.argv if not arg.startswith("--")]
+
+def validateSingleParamaters():
+    # In single-connection mode there is no data port, and "-g" may name several files, which are fetched one after another over the same connection
+    if (len(sys.argv) < 4 or ((sys.argv[3] == "-g" or sys.argv[3] == "-b" or sys.argv[3] == "-p") and len(sys.argv) < 5)):
+        print "Too few arguments."
+        exit(1)
+    if (sys.argv[3] == "-l" and len(sys.argv) != 4):
+        print "Too many arguments for -l command."
+        exit(1)
+    if (sys.argv[1] != "flip1" and sys.argv[1] != "flip2" and sys.argv[1] != "flip3"):
+        print "Please use flip1, flip2 or flip3 as the server host name."
+        exit(1)
+    if (int(sys.argv[2]) > 65535 or int(sys.argv[2]) < 1024):
+        print "Please use a port number between 1024-65535."
+        exit(1)
+
+def validateBatchParamaters():
+    # "-b" takes any number of file names and glob patterns, followed by the data port
+    if (len(sys.argv) < 6):
+        print "Too few arguments for -b command."
+        exit(1)
+    if (sys.argv[1] != "flip1" and sys.argv[1] != "flip2" and sys.argv[1] != "flip3"):
+        print "Please use flip1, flip2 or flip3 as the server host name."
+        exit(1)
+    if (int(sys.argv[2]) > 65535 or int(sys.argv[2]) < 1024 or int(sys.argv[-1]) > 65535 or int(sys.argv[-1]) < 1024):
+        print "Please use a port number between 1024-65535."
+        exit(1)
+
+def validateStatsParamaters():
+    # "-s" takes no other arguments, and the server only answers it for a client on its own host
+    if (len(sys.argv) != 4):
+        print "-s takes no other arguments."
+        exit(1)
+    if (sys.argv[1] != "flip1" and sys.argv[1] != "flip2" and sys.argv[1] != "flip3"):
+        print "Please use flip1, flip2 or flip3 as the server host name."
+        exit(1)
+    if (int(sys.argv[2]) > 65535 or int(sys.argv[2]) < 1024):
+        print "Please use a port number between 1024-65535."
+        exit(1)
 
 def validateParamaters():
+    if (len(sys.argv) > 3 and sys.argv[3] == "-s"):
+        validateStatsParamaters()
+        return
+    if "single" in options:
+        validateSingleParamaters()
+        return
+    if (len(sys.argv) > 3 and sys.argv[3] == "-b"):
+        validateBatchParamaters()
+        return
     if (len(sys.argv) < 5):
         print "Too few arguments."
         exit(1)
@@ -25,14 +153,62 @@ def validateParamaters():
         if (int(sys.argv[4]) > 65535 or int(sys.argv[4]) < 1024):
             print "Please use a port number between 1024-65535."
             exit(1)
-    if (sys.argv[3] == "-g" and len(sys.argv) != 6):
-        print "Too many arguments for -g command."
+    if ((sys.argv[3] == "-g" or sys.argv[3] == "-p") and len(sys.argv) != 6):
+        print "Too many arguments for {} command.".format(sys.argv[3])
         exit(1)
-    if (sys.argv[3] == "-g"):
+    if (sys.argv[3] == "-p" and not os.path.isfile(sys.argv[4])):
+        print "{} is not a file.".format(sys.argv[4])
+        exit(1)
+    if (sys.argv[3] == "-g" or sys.argv[3] == "-p"):
         if (int(sys.argv[5]) > 65535 or int(sys.argv[5]) < 1024):
             print "Please use a port number between 1024-65535."
             exit(1)
 
+def sendFrame(socketFD, opcode, flags=0, value=0, payload=""):
+    # Send a version 2 frame: the header followed by the payload. I utilized: https://docs.python.org/2/library/struct.html
+    socketFD.sendall(FRAME_HEADER.pack(PROTOCOL_VERSION, opcode, flags, len(payload), value) + payload)
+
+def recvExactly(socketFD, length):
+    # recv() may return fewer bytes than asked for, so keep reading until all of them have arrived
+    chunks = []
+    while length > 0:
+        chunk = socketFD.recv(min(length, RECEIVE_SIZE))
+        if not chunk:
+            print "Connection closed by server."
+            exit(1)
+        chunks.append(chunk)
+        length -= len(chunk)
+    return "".join(chunks)
+
+def recvFrame(socketFD, header=None):
+    # Receive a version 2 frame and return its opcode, flags, value and payload
+    if header is None:
+        header = recvExactly(socketFD, FRAME_HEADER.size)
+    version, opcode, flags, length, value = FRAME_HEADER.unpack(header)
+    return opcode, flags, value, recvExactly(socketFD, length)
+
+def preallocate(fileObject, size):
+    # Reserve the space for the whole file before it arrives. os.posix_fallocate() was added in Python 3.3, so otherwise set the size of the file
+    if hasattr(os, "posix_fallocate"):
+        os.posix_fallocate(fileObject.fileno(), 0, size)
+    else:
+        fileObject.truncate(size)
+
+def getClientIP():
+    # Find the IP address for the client to send to server. I utilized: https://stackoverflow.com/questions/166506/finding-local-ip-addresses-using-pythons-stdlib
+    s = socket(AF_INET, SOCK_DGRAM)
+    s.connect(("8.8.8.8", 80))
+    return s.getsockname()[0]
+
+def listenForData(portNum):
+    # Create a socket file descriptor with the address of the socket and the type of socket, which is TCP. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip
+    newestSocketFD = socket(AF_INET, SOCK_STREAM)
+    # Bind the server to an available IP address at specified port number. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip and https://www.geeksforgeeks.org/simple-chat-room-using-python/
+    newestSocketFD.bind(('', int(portNum)))
+    # Listen for 1 connection at a time. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip
+    newestSocketFD.listen(1)
+    return newestSocketFD
+
 def initiateContact():
     # Concatentate the server host name with the path for the host name. I utilized: https://realpython.com/python-string-split-concatenate-join/
     hostName = sys.argv[1] + ".engr.oregonstate.edu"
@@ -68,11 +244,19 @@ def receiveData(newSConnection):
         fileBuffer = newSConnection.recv(100)
         # Open a file with the name indicated by the user to write the data that will be sent by the server program and point the fileName to that file. I utilized: https://www.w3schools.com/python/python_file_write.asp
         fileName = open(sys.argv[4], 'w')
-        # This while loop will continue until it finds the sequence "EOF" in the fileBuffer. I utilized: https://www.geeksforgeeks.org/python-membership-identity-operators-not-not/
-        while "EOF" not in fileBuffer:
+        # The server closes the TCP data connection right after the "EOF" marker, so read until then and hold back the last 3 bytes in case they are the marker.
+        # Checking each chunk for "EOF" would drop any file data that arrives in the same chunk as the marker, or that happens to contain "EOF"
+        while True:
+            chunk = newSConnection.recv(RECEIVE_SIZE)
+            if not chunk:
+                break
+            fileBuffer += chunk
             # Append the content held by fileBuffer to the file pointed to be fileName. I utilized: https://www.w3schools.com/python/python_file_write.asp
-            fileName.write(fileBuffer)
-            fileBuffer = newSConnection.recv(100)
+            fileName.write(fileBuffer[:-3])
+            fileBuffer = fileBuffer[-3:]
+        if fileBuffer.endswith("EOF"):
+            fileBuffer = fileBuffer[:-3]
+        fileName.write(fileBuffer)
         print "File transfer complete."
 
 def makeRequest(newSocketFD):
@@ -83,6 +267,8 @@ def makeRequest(newSocketFD):
 
     # Set the portNum variable to the port number input by the user
     portNum = sys.argv[portNumPos]
+    # Start listening on the data port before the request is sent, so the server never tries to connect before the client is ready
+    newestSocketFD = listenForData(portNum)
     # Send a message to the server containing the port number that will be used. I utilized: https://www.geeksforgeeks.org/simple-chat-room-using-python/
     newSocketFD.send(portNum)
     # Receive the initial message sent by server. I utilized: https://www.geeksforgeeks.org/simple-chat-room-using-python/
@@ -98,10 +284,7 @@ def makeRequest(newSocketFD):
     # Receive the next message sent by server. I utilized: https://www.geeksforgeeks.org/simple-chat-room-using-python/
     newSocketFD.recv(512) 
 
-    # Find the IP address for the client to send to server. I utilized: https://stackoverflow.com/questions/166506/finding-local-ip-addresses-using-pythons-stdlib
-    s = socket(AF_INET, SOCK_DGRAM)
-    s.connect(("8.8.8.8", 80))
-    clientIP = s.getsockname()[0]
+    clientIP = getClientIP()
 
     # Send a message to the server containing the client's IP address. I utilized: https://www.geeksforgeeks.org/simple-chat-room-using-python/
     newSocketFD.send(clientIP)
@@ -123,12 +306,6 @@ def makeRequest(newSocketFD):
             print "{}: {} says FILE NOT FOUND".format(pEHost, pEPort)
             return
     
-    # Create a socket file descriptor with the address of the socket and the type of socket, which is TCP. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip 
-    newestSocketFD = socket(AF_INET, SOCK_STREAM)
-    # Bind the server to an available IP address at specified port number. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip and https://www.geeksforgeeks.org/simple-chat-room-using-python/
-    newestSocketFD.bind(('', int(portNum)))
-    # Listen for 1 connection at a time. I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip 
-    newestSocketFD.listen(1)
     # Accepts a connection request and stores 2 parameters: the socket object for that user and the IP address of the server that has just connected
     # I utilized: https://stackoverflow.com/questions/8033552/python-socket-bind-to-any-ip 
     newSocketConnection, newAddress = newestSocketFD.accept()
@@ -137,9 +314,452 @@ def makeRequest(newSocketFD):
     # Close the connection on the socket file descriptor. I utilized: https://www.geeksforgeeks.org/simple-chat-room-using-python/
     newSocketConnection.close()
 
+def receiveDataV2(newSConnection, pFile, pPort):
+    # Version 2 sends the directory listing as one entry frame per file name, followed by an end frame
+    if sys.argv[3] == "-l":
+        pLHost = sys.argv[1]
+        print "Receiving directory structure from {}: {}".format(pLHost, pPort)
+        opcode, flags, value, payload = recvFrame(newSConnection)
+        while opcode == OP_ENTRY:
+            print payload
+            opcode, flags, value, payload = recvFrame(newSConnection)
+    # Version 2 sends a file frame holding the size of the file, the contents of the file and then an end frame, so the contents never have to be scanned for a marker
+    else:
+        pGHost = sys.argv[1]
+        print "Receiving {} from {}: {}".format(pFile, pGHost, pPort)
+        opcode, flags, fileSize, payload = recvFrame(newSConnection)
+        if opcode != OP_FILE:
+            print "Unexpected reply from server."
+            exit(1)
+        if flags & FLAG_RANGE:
+            # Only part of the file is coming, so write it into place without truncating what is already there. I utilized: https://docs.python.org/2/library/functions.html#open
+            offset, totalSize = RANGE.unpack(payload[:RANGE.size])
+            fileName = open(pFile, 'r+b' if os.path.exists(pFile) else 'wb')
+            fileName.seek(offset)
+            print "Receiving bytes {} to {} of {}.".format(offset, offset + fileSize, totalSize)
+        else:
+            fileName = open(pFile, 'wb')
+            preallocate(fileName, fileSize)
+        received, wireBytes, checksum = receiveContents(newSConnection, fileName, fileSize, flags)
+        if received < fileSize:
+            # Keep only the bytes that arrived, so that --resume can continue from the end of the file
+            if not flags & FLAG_RANGE or "resume" in options:
+                fileName.truncate(fileName.tell())
+            print "Connection closed before the transfer was complete."
+            exit(1)
+        fileName.close()
+        endOpcode, endFlags, expected, _ = recvFrame(newSConnection)
+        if not checksumMatches(endFlags, expected, checksum):
+            exit(1)
+        if flags & sum(DECOMPRESSORS):
+            print "Received {} bytes for {} bytes of file contents, {} saved by compression.".format(wireBytes, fileSize, fileSize - wireBytes)
+        print "File transfer complete."
+
+def receiveContents(newSConnection, fileObject, size, flags=0):
+    # Write the next size bytes of file contents received on the connection to the file, updating their checksum on the way so the file never has to be read again.
+    # Return the number of bytes written, which is less than size if the connection closed early, the number of bytes received and the checksum
+    remaining = size
+    compression = flags & sum(DECOMPRESSORS)
+    verify = verifying()
+    checksum = 0
+    while remaining > 0 and not compression:
+        fileBuffer = newSConnection.recv(min(remaining, RECEIVE_SIZE))
+        if not fileBuffer:
+            break
+        fileObject.write(fileBuffer)
+        if verify:
+            checksum = updateChecksum(fileBuffer, checksum)
+        remaining -= len(fileBuffer)
+    # Compressed contents arrive as block frames, each holding its size once decompressed in its value and, in its flags, the compressor or 0 if it is stored as is
+    wireBytes = size - remaining
+    while remaining > 0 and compression:
+        try:
+            opcode, blockFlags, blockSize, fileBuffer = recvFrame(newSConnection)
+        # recvFrame() exits when the connection closes, but the bytes that arrived so far must still be kept for --resume
+        except SystemExit:
+            break
+        wireBytes += FRAME_HEADER.size + len(fileBuffer)
+        if blockFlags:
+            fileBuffer = DECOMPRESSORS[blockFlags](fileBuffer, blockSize)
+        fileObject.write(fileBuffer)
+        if verify:
+            checksum = updateChecksum(fileBuffer, checksum)
+        remaining -= len(fileBuffer)
+    return size - remaining, wireBytes, checksum
+
+def checksumMatches(flags, expected, checksum):
+    # Compare the checksum the server sent in the end frame with the one computed while the file contents arrived
+    if not verifying() or not flags & FLAG_CHECKSUM or expected == checksum:
+        return True
+    print "Checksum mismatch: the file contents that arrived are not the ones the server sent."
+    return False
+
+def openSession(newSocketFD):
+    # Open a version 2 session. A server that only speaks version 1 takes the hello frame for a port number and answers "NE" instead of a hello frame
+    sendFrame(newSocketFD, OP_HELLO, value=PROTOCOL_VERSION)
+    header = newSocketFD.recv(FRAME_HEADER.size)
+    if not header or ord(header[0]) != PROTOCOL_VERSION:
+        print "Server does not support protocol version 2. Please use --v1."
+        exit(1)
+    recvFrame(newSocketFD, header + recvExactly(newSocketFD, FRAME_HEADER.size - len(header)))
+
+def requestedRange(fileName):
+    # --resume continues from the end of a partial local copy of the file, while --offset and --length ask for any part of it. Return None to request the whole file
+    if sys.argv[3] != "-g":
+        return None
+    if "resume" in options:
+        offset = os.path.getsize(fileName) if os.path.exists(fileName) else 0
+    elif "offset" in options or "length" in options:
+        offset = int(options.get("offset") or 0)
+    else:
+        return None
+    return offset, int(options.get("length") or 0)
+
+def sendRequest(newSocketFD, fileName, portNum=0, clientIP="", flags=0, byteRange=None, value=0):
+    # A request holds the data port, the length of the client's IP address, the byte range if there is one, the IP address and the file name
+    opcodes = {"-l": OP_LIST, "-g": OP_GET, "-b": OP_BATCH, "-p": OP_PUT}
+    if byteRange is None:
+        byteRange = requestedRange(fileName)
+    rangeFields = ""
+    if byteRange is not None:
+        flags |= FLAG_RANGE
+        rangeFields = RANGE.pack(*byteRange)
+    # Ask for the checksum of the file contents if the client is going to check it
+    if verifying() and sys.argv[3] != "-l":
+        flags |= FLAG_CHECKSUM
+    # With --compress, tell the server which compressors the client can decompress, and it decides whether the file is worth compressing
+    if "compress" in options and sys.argv[3] != "-l" and sys.argv[3] != "-p":
+        flags |= sum(DECOMPRESSORS)
+    payload = struct.pack(">HH", int(portNum), len(clientIP)) + rangeFields + clientIP + fileName
+    sendFrame(newSocketFD, opcodes.get(sys.argv[3], 0), flags, value, payload)
+
+def checkReply(newSocketFD):
+    # Receive the server's answer to a request. Return True if the request was accepted
+    opcode, flags, value, message = recvFrame(newSocketFD)
+    if opcode == OP_ERROR and flags == ERROR_FILE:
+        pEHost = sys.argv[1]
+        pEPort = int(sys.argv[2])
+        print "{}: {} says FILE NOT FOUND".format(pEHost, pEPort)
+        return False
+    if opcode == OP_ERROR:
+        print message
+        exit(1)
+    return True
+
+def makeRequestV2(newSocketFD):
+    if (sys.argv[3] == "-l" or len(sys.argv) == 5):
+        portNumPos = 4
+    else:
+        portNumPos = 5
+    portNum = sys.argv[portNumPos]
+    # Start listening on the data port before the request is sent, so the server never tries to connect before the client is ready
+    newestSocketFD = listenForData(portNum)
+
+    openSession(newSocketFD)
+
+    fileName = sys.argv[4] if sys.argv[3] == "-g" else ""
+    sendRequest(newSocketFD, fileName, portNum, getClientIP())
+    if not checkReply(newSocketFD):
+        return
+
+    # Accepts a connection request and stores 2 parameters: the socket object for that user and the IP address of the server that has just connected
+    newSocketConnection, newAddress = newestSocketFD.accept()
+
+    receiveDataV2(newSocketConnection, fileName, portNum)
+    newSocketConnection.close()
+
+def requestFileSize(newSocketFD, fileName):
+    # A stat request has the same layout as a get request, and the server answers it with the size of the file instead of sending the file
+    sendFrame(newSocketFD, OP_STAT, payload=struct.pack(">HH", 0, 0) + fileName)
+    opcode, flags, fileSize, message = recvFrame(newSocketFD)
+    if opcode == OP_ERROR and flags == ERROR_FILE:
+        print "{}: {} says FILE NOT FOUND".format(sys.argv[1], int(sys.argv[2]))
+        return None
+    if opcode == OP_ERROR:
+        print message
+        exit(1)
+    return fileSize
+
+def streamingListing():
+    return sys.argv[3] == "-l" and ("details" in options or "recursive" in options or "prefix" in options or "page" in options)
+
+def printRecords(payload, flags):
+    position = 0
+    while position < len(payload):
+        length, kind = RECORD.unpack_from(payload, position)
+        position += RECORD.size
+        if flags & FLAG_DETAILS:
+            size, mtime = DETAILS.unpack_from(payload, position)
+            position += DETAILS.size
+        name = payload[position:position + length]
+        position += length
+        if flags & FLAG_DETAILS:
+            # I utilized: https://docs.python.org/2/library/time.html#time.strftime
+            print "{} {:>12} {} {}".format(TYPES.get(kind, "?"), size, time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(mtime // 1000000000)), name)
+        else:
+            print name + ("/" if kind == 4 else "")
+
+def makeListingRequest(newSocketFD):
+    # --details, --recursive, --prefix=<path prefix> and --page=<entries> ask for a streaming listing, which the server sends as it reads the directory, many records per frame.
+    # With --page, each request returns at most that many entries and an end frame holding a cursor, which the next request sends back after the prefix to continue the listing
+    portNum = None if "single" in options else sys.argv[4]
+    newestSocketFD = listenForData(portNum) if portNum else None
+    flags = FLAG_STREAM | (FLAG_DETAILS if "details" in options else 0) | (FLAG_RECURSIVE if "recursive" in options else 0)
+    pageSize = int(options.get("page") or 0)
+
+    openSession(newSocketFD)
+    print "Receiving directory structure from {}: {}".format(sys.argv[1], portNum or sys.argv[2])
+    cursor = ""
+    total = 0
+    while True:
+        listOptions = options.get("prefix", "") + ("\0" + cursor if cursor else "")
+        if portNum:
+            sendRequest(newSocketFD, listOptions, portNum, getClientIP(), flags, value=pageSize)
+        else:
+            sendRequest(newSocketFD, listOptions, flags=flags | FLAG_SINGLE_CONNECTION, value=pageSize)
+        checkReply(newSocketFD)
+        newSConnection = newestSocketFD.accept()[0] if newestSocketFD else newSocketFD
+        opcode, recordFlags, count, payload = recvFrame(newSConnection)
+        while opcode == OP_RECORDS:
+            printRecords(payload, recordFlags)
+            opcode, recordFlags, count, payload = recvFrame(newSConnection)
+        if newSConnection is not newSocketFD:
+            newSConnection.close()
+        total += count
+        # The end frame holds the cursor of the next page, or nothing once the listing is complete
+        cursor = payload
+        if not cursor:
+            break
+    print "{} entries.".format(total)
+    newSocketFD.close()
+
+def makeUploadRequest(newSocketFD):
+    # -p sends a local file to the server, which writes it under a temporary name and only gives it the file's name once all of it has arrived.
+    # The server answers the request with OK, the client sends the contents and an end frame holding their checksum, and the server reports the result on the TCP control connection
+    if "single" in options:
+        fileNames, portNum = sys.argv[4:], None
+    else:
+        fileNames, portNum = sys.argv[4:5], sys.argv[5]
+    newestSocketFD = listenForData(portNum) if portNum else None
+    verify = verifying()
+
+    openSession(newSocketFD)
+    for pFile in fileNames:
+        if not os.path.isfile(pFile):
+            print "{} is not a file.".format(pFile)
+            continue
+        fileSize = os.path.getsize(pFile)
+        name = os.path.basename(pFile)
+        if portNum:
+            sendRequest(newSocketFD, name, portNum, getClientIP(), value=fileSize)
+        else:
+            sendRequest(newSocketFD, name, flags=FLAG_SINGLE_CONNECTION, value=fileSize)
+        opcode, flags, value, message = recvFrame(newSocketFD)
+        if opcode == OP_ERROR:
+            print "{}: {} says {}".format(sys.argv[1], int(sys.argv[2]), message)
+            continue
+
+        newSConnection = newestSocketFD.accept()[0] if newestSocketFD else newSocketFD
+        print "Sending {} to {}: {}".format(pFile, sys.argv[1], portNum or sys.argv[2])
+        checksum = 0
+        remaining = fileSize
+        with open(pFile, 'rb') as fileObject:
+            while remaining > 0:
+                fileBuffer = fileObject.read(min(remaining, RECEIVE_SIZE))
+                if not fileBuffer:
+                    break
+                newSConnection.sendall(fileBuffer)
+                if verify:
+                    checksum = updateChecksum(fileBuffer, checksum)
+                remaining -= len(fileBuffer)
+        if remaining > 0:
+            print "{} shrank while it was being sent.".format(pFile)
+            exit(1)
+        sendFrame(newSConnection, OP_END, FLAG_CHECKSUM if verify else 0, checksum)
+        if newSConnection is not newSocketFD:
+            newSConnection.close()
+
+        opcode, flags, value, message = recvFrame(newSocketFD)
+        if opcode == OP_ERROR:
+            print "{}: {} says {}".format(sys.argv[1], int(sys.argv[2]), message)
+            exit(1)
+        print "File transfer complete."
+
+    newSocketFD.close()
+
+def requestStats(newSocketFD):
+    # -s asks the server for its counters, which the OK frame holds in the Prometheus text format
+    openSession(newSocketFD)
+    sendFrame(newSocketFD, OP_STATS)
+    opcode, flags, length, text = recvFrame(newSocketFD)
+    if opcode == OP_ERROR:
+        print "{}: {} says {}".format(sys.argv[1], int(sys.argv[2]), text)
+        exit(1)
+    sys.stdout.write(text)
+    newSocketFD.close()
+
+def receiveStream(pFile, offset, length, portNum, completed, stream):
+    # Each stream opens its own TCP control connection, asks for its range of the file and writes the range into place.
+    # Python 2 has no os.pwrite(), so each stream has its own file object and seeks it to the start of its range. I utilized: https://docs.python.org/2/library/threading.html
+    newSocketFD = initiateContact()
+    newestSocketFD = None
+    try:
+        openSession(newSocketFD)
+        if portNum:
+            newestSocketFD = listenForData(portNum)
+            sendRequest(newSocketFD, pFile, portNum, getClientIP(), byteRange=(offset, length))
+        else:
+            sendRequest(newSocketFD, pFile, flags=FLAG_SINGLE_CONNECTION, byteRange=(offset, length))
+        if not checkReply(newSocketFD):
+            return
+        newSConnection = newestSocketFD.accept()[0] if newestSocketFD else newSocketFD
+        opcode, flags, size, payload = recvFrame(newSConnection)
+        fileObject = open(pFile, 'r+b')
+        fileObject.seek(offset)
+        received, wireBytes, checksum = receiveContents(newSConnection, fileObject, size, flags) if opcode == OP_FILE else (0, 0, 0)
+        fileObject.close()
+        endOpcode, endFlags, expected, _ = recvFrame(newSConnection)
+        completed[stream] = received == length and checksumMatches(endFlags, expected, checksum)
+        if newSConnection is not newSocketFD:
+            newSConnection.close()
+    # recvExactly() exits when the connection closes, which in a thread only ends that thread
+    except (error, IOError, SystemExit):
+        completed[stream] = False
+    finally:
+        newSocketFD.close()
+        if newestSocketFD:
+            newestSocketFD.close()
+
+def makeParallelRequests(newSocketFD):
+    # --streams=N splits each file into N ranges that are fetched at the same time over N connections. With a data port, stream i listens on the data port + i
+    openSession(newSocketFD)
+    streamCount = max(1, int(options["streams"]))
+    if "single" in options:
+        fileNames, firstPort = sys.argv[4:], None
+    else:
+        fileNames, firstPort = [sys.argv[4]], int(sys.argv[5])
+
+    for pFile in fileNames:
+        fileSize = requestFileSize(newSocketFD, pFile)
+        if fileSize is None:
+            continue
+        count = max(1, min(streamCount, fileSize // MIN_STREAM_SIZE))
+        rangeSize = (fileSize + count - 1) // count
+        print "Receiving {} from {}: {} over {} streams".format(pFile, sys.argv[1], sys.argv[2], count)
+
+        fileObject = open(pFile, 'wb')
+        preallocate(fileObject, fileSize)
+        fileObject.close()
+
+        completed = [False] * count
+        threads = []
+        for stream in range(count):
+            offset = stream * rangeSize
+            portNum = firstPort + stream if firstPort else None
+            thread = threading.Thread(target=receiveStream, args=(pFile, offset, max(0, min(rangeSize, fileSize - offset)), portNum, completed, stream))
+            thread.start()
+            threads.append(thread)
+        for thread in threads:
+            thread.join()
+
+        if not all(completed):
+            print "Connection closed before the transfer was complete."
+            exit(1)
+        print "File transfer complete."
+
+    newSocketFD.close()
+
+def makeSingleRequests(newSocketFD):
+    # In single-connection mode the listing or files come back over the TCP control connection, so there is no data port to listen on and no second connection to open
+    openSession(newSocketFD)
+
+    fileNames = sys.argv[4:] if sys.argv[3] == "-g" else [""]
+    # The connection stays open between requests, so send every request up front and then read the answers in the same order
+    for fileName in fileNames:
+        sendRequest(newSocketFD, fileName, flags=FLAG_SINGLE_CONNECTION)
+    for fileName in fileNames:
+        if checkReply(newSocketFD):
+            receiveDataV2(newSocketFD, fileName, sys.argv[2])
+
+    newSocketFD.close()
+
+def makeBatchRequest(newSocketFD):
+    # -b asks for every file named or matched by a glob pattern in one request. The server answers with the number of files and sends them back to back over one connection,
+    # each as a file frame, its contents and an end frame, or as an error frame if the file has disappeared. Quote the patterns so that the local shell does not expand them
+    if "single" in options:
+        patterns, portNum = sys.argv[4:], None
+    else:
+        patterns, portNum = sys.argv[4:-1], sys.argv[-1]
+    newestSocketFD = listenForData(portNum) if portNum else None
+
+    openSession(newSocketFD)
+    names = "".join(pattern + "\0" for pattern in patterns)
+    if portNum:
+        sendRequest(newSocketFD, names, portNum, getClientIP())
+    else:
+        sendRequest(newSocketFD, names, flags=FLAG_SINGLE_CONNECTION)
+    opcode, flags, fileCount, message = recvFrame(newSocketFD)
+    if opcode == OP_ERROR:
+        print "{}: {} says {}".format(sys.argv[1], int(sys.argv[2]), message)
+        exit(1)
+
+    newSConnection = newestSocketFD.accept()[0] if newestSocketFD else newSocketFD
+    print "Receiving {} files from {}: {}".format(fileCount, sys.argv[1], portNum or sys.argv[2])
+    failed = 0
+    for i in range(fileCount):
+        opcode, flags, fileSize, payload = recvFrame(newSConnection)
+        if opcode == OP_ERROR:
+            print "{}: {} says FILE NOT FOUND: {}".format(sys.argv[1], int(sys.argv[2]), payload)
+            failed += 1
+            continue
+        # The server only sends names from its own directory, but never write outside the current directory
+        pFile = os.path.basename(payload)
+        fileObject = open(pFile, 'wb')
+        preallocate(fileObject, fileSize)
+        received, wireBytes, checksum = receiveContents(newSConnection, fileObject, fileSize, flags)
+        fileObject.close()
+        if received < fileSize:
+            print "Connection closed before the transfer of {} was complete.".format(pFile)
+            exit(1)
+        endOpcode, endFlags, expected, _ = recvFrame(newSConnection)
+        if not checksumMatches(endFlags, expected, checksum):
+            failed += 1
+    print "Batch transfer complete: {} of {} files received.".format(fileCount - failed, fileCount)
+
+    if newSConnection is not newSocketFD:
+        newSConnection.close()
+    newSocketFD.close()
+
 if __name__ == "__main__":
+    parseOptions()
+
     validateParamaters()
 
+    if not fastChecksum and "verify" not in options and "no-verify" not in options and "v1" not in options and sys.argv[3] in ("-g", "-b", "-p"):
+        print "The crc32c Python module is not installed, so checksums are not checked. Add --verify to check them anyway."
+
     socketFD = initiateContact()
 
-    makeRequest(socketFD)
+    # The framed version 2 protocol is used unless --v1 is given. --single sends everything over the TCP control connection
+    if "v1" in options:
+        if sys.argv[3] == "-b" or sys.argv[3] == "-s" or sys.argv[3] == "-p":
+            print "{} needs protocol version 2.".format(sys.argv[3])
+            exit(1)
+        if "resume" in options or "offset" in options or "length" in options or "streams" in options or "compress" in options or streamingListing():
+            print "--resume, --offset, --length, --streams, --compress, --details, --recursive, --prefix and --page need protocol version 2."
+            exit(1)
+        makeRequest(socketFD)
+    elif sys.argv[3] == "-s":
+        requestStats(socketFD)
+    elif sys.argv[3] == "-b":
+        makeBatchRequest(socketFD)
+    elif streamingListing():
+        makeListingRequest(socketFD)
+    elif sys.argv[3] == "-p":
+        makeUploadRequest(socketFD)
+    elif "streams" in options and sys.argv[3] == "-g":
+        makeParallelRequests(socketFD)
+    elif "single" in options:
+        makeSingleRequests(socketFD)
+    else:
+        makeRequestV2(socketFD)
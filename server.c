@@ -1,30 +1,579 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <endian.h>
+#include <limits.h>
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#elif defined(USE_LZ4)
+#include <lz4.h>
+#elif defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 /* Global variables */
 #define BUFFER_SIZE 100
+#define MAX_EVENTS 256                                                          /* Maximum number of events returned by a single call to epoll_wait() */
+#define CONNECT_RETRY_MS 50                                                     /* Delay between attempts to open the TCP data connection to client */
+#define CONNECT_ATTEMPTS 40                                                     /* Number of attempts to open the TCP data connection before giving up */
+#define SEND_CHUNK_SIZE (1 << 20)                                               /* Largest amount of the file handed to sendfile() or splice() in one call */
+#define PUMP_BUDGET (8 << 20)                                                   /* Bytes sent to one client before the other clients of the worker get a turn */
+#define BATCH_FILE_COST (64 * 1024)                                             /* Budget used up by each file of a batch on top of its contents, so that many small files also give other clients a turn */
+#define PROTOCOL_VERSION 2                                                      /* Version of the framed protocol. Clients that do not open with a hello frame speak version 1 */
+#define FRAME_HEADER_SIZE 16                                                    /* Version, opcode, flags, payload length and value */
+#define MAX_REQUEST_SIZE 4096                                                   /* Largest frame payload accepted on the TCP control connection */
+#define MAX_BATCH_SIZE (1 << 20)                                                /* Largest batch request, whose payload lists file names and patterns */
+#define CACHED_FILES 256                                                        /* Default number of open files kept by the hot-file cache, set with the -F option */
+#define CACHED_MEGABYTES 256                                                    /* Default size of the files the hot-file cache may map, set with the -M option */
+#define INDEX_BUCKETS 1024                                                      /* Initial number of hash buckets in the directory index */
+#define LOG_BUFFER_SIZE (256 * 1024)                                            /* Log lines waiting for the logger thread to write them out */
+#define LOG_LINE_SIZE 512                                                       /* Longest log line, longer ones are cut short */
+#define LOG_LINES_PER_SECOND 1000                                               /* Log lines accepted per second, further lines are dropped and counted */
+#define HISTOGRAM_BUCKETS 40                                                    /* Power of two buckets of each latency and throughput histogram */
+#define LIST_READ_SIZE (64 * 1024)                                              /* Bytes of directory entries read by each getdents64() call of a streaming listing */
+#define LIST_FRAME_SIZE (64 * 1024)                                             /* Records packed into each records frame of a streaming listing */
+#define LIST_FRAME_COST (1 << 20)                                               /* Budget used up by each records frame, whose entries may each have needed a stat */
+#define LIST_DEPTH 8                                                            /* Deepest subdirectory a recursive listing descends into, which bounds its open directories and cursor */
+#define UPLOAD_MIN_CHUNK (128 * 1024)                                           /* Least amount an upload held back by its rate receives at once */
+#define UPLOAD_PREFIX ".upload-"                                                /* Start of the names of files being uploaded, which are never listed or sent */
+#define UPLOAD_SYNC_SIZE (8 << 20)                                              /* Bytes of an upload written before their writeback is started, so that little is left for the final fdatasync() */
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)    /* Changes that keep the directory index up to date */
+
+#define PREFETCH_WINDOW (2 << 20)                                               /* Part of a file checked to be in the page cache, and read into it if it is not, before it is sent */
+#ifndef __NR_cachestat
+#define __NR_cachestat 451                                                      /* Same number on every architecture, for C libraries that predate it */
+#endif
+#define PROBE_SIZE (16 * 1024)                                                  /* Buffer every page of a window is read into to check that it is in the page cache */
+#define PREFETCH_CHUNK (256 * 1024)                                             /* Bytes read at a time to bring a window of a file into the page cache */
+#define PREFETCH_THREADS 4                                                      /* Default number of prefetch threads, set with the -P option */
+#ifdef USE_IO_URING
+#define RING_ENTRIES 64                                                         /* Submission queue entries of each worker's io_uring instance */
+#define RING_BUFFERS 8                                                          /* Registered buffers, and so prefetches in flight, of each worker's io_uring instance */
+#endif
+
+enum channelKind { CHANNEL_LISTEN, CHANNEL_CONTROL, CHANNEL_DATA, CHANNEL_WAKE };
+
+enum transferMode { MODE_SENDFILE, MODE_SPLICE, MODE_COPY };
+
+enum frameOpcode {
+    OP_HELLO = 1,                                                               /* Both directions: opens a version 2 session, value holds the version */
+    OP_LIST,                                                                    /* Client: list the directory */
+    OP_GET,                                                                     /* Client: get the file named in the payload */
+    OP_OK,                                                                      /* Server: the request was accepted */
+    OP_ERROR,                                                                   /* Server: the request was rejected, flags hold the error code and payload a message */
+    OP_ENTRY,                                                                   /* Server: one directory entry, payload holds the name */
+    OP_FILE,                                                                    /* Server: value bytes of file contents follow, payload holds the name (after the range, for a range request) */
+    OP_END,                                                                     /* Server: the directory listing or file is complete */
+    OP_STAT,                                                                    /* Client: get the size of the file named in the payload, which the ok frame holds in its value */
+    OP_BLOCK,                                                                   /* Server: one block of compressed file contents, value holds its size once decompressed and flags the compressor (0 if stored as is) */
+    OP_BATCH,                                                                   /* Client: get every file named or matched by a glob pattern in the payload, each sent as a file frame, its contents and an end frame */
+    OP_STATS,                                                                   /* Client on the server's host: get the server's counters, which the ok frame holds as Prometheus text */
+    OP_RECORDS,                                                                 /* Server: directory entries of a streaming listing, value holds their number and payload the records */
+    OP_PUT                                                                      /* Client: store the file named in the payload, whose value bytes of contents and an end frame follow the ok frame */
+};
+
+enum errorCode { ERROR_COMMAND = 1, ERROR_FILE, ERROR_REQUEST, ERROR_RANGE, ERROR_UPLOAD };
+
+enum requestKind { REQUEST_LIST, REQUEST_GET, REQUEST_STAT, REQUEST_BATCH, REQUEST_STATS, REQUEST_PUT, REQUEST_KINDS };
+
+enum failureKind { FAILURE_COMMAND, FAILURE_FILE, FAILURE_REQUEST, FAILURE_RANGE, FAILURE_UPLOAD, FAILURE_CONNECT, FAILURE_SEND, FAILURE_KINDS };    /* The first five match the error codes sent to client */
+
+enum requestFlag {
+    FLAG_SINGLE_CONNECTION = 0x0001,                                            /* Send the listing or file over the TCP control connection instead of a TCP data connection */
+    FLAG_RANGE = 0x0002,                                                        /* Get: the request holds an offset and a length (0 for the rest of the file), and the file frame holds the offset and the file size */
+    FLAG_ZLIB = 0x0004,                                                         /* Get: client can decompress zlib blocks. File and block frames: the contents are compressed with zlib */
+    FLAG_LZ4 = 0x0008,                                                          /* Same for LZ4 */
+    FLAG_ZSTD = 0x0010,                                                         /* Same for zstd */
+    FLAG_CHECKSUM = 0x0020,                                                     /* Get: client verifies the file contents. End frame: value holds the CRC32C of the file contents that were sent */
+    FLAG_STREAM = 0x0040,                                                       /* List: walk the directory instead of sending the index, value holds the page size and payload a prefix and a cursor */
+    FLAG_DETAILS = 0x0080,                                                      /* List: records also hold the size and mtime of each entry. Records frame: they do */
+    FLAG_RECURSIVE = 0x0100                                                     /* List: descend into subdirectories */
+};
+
+#define COMPRESSION_FLAGS (FLAG_ZLIB | FLAG_LZ4 | FLAG_ZSTD)
+#define COMPRESS_BLOCK_SIZE (128 * 1024)                                        /* File contents compressed into each block frame */
+#define CHECKSUM_CHUNK_SIZE (256 * 1024)                                        /* Bytes read back at a time to checksum what sendfile() and splice() sent */
+#define COMPRESSION_MAX_RATIO 90                                                /* A file is only compressed if its first block shrinks to this percentage of its size or less */
+
+#if defined(USE_ZSTD)                                                           /* The compressor is chosen at build time with -DUSE_ZSTD, -DUSE_LZ4 or -DUSE_ZLIB */
+#define COMPRESSION_FLAG FLAG_ZSTD
+#define COMPRESSION_NAME "zstd"
+#elif defined(USE_LZ4)
+#define COMPRESSION_FLAG FLAG_LZ4
+#define COMPRESSION_NAME "LZ4"
+#elif defined(USE_ZLIB)
+#define COMPRESSION_FLAG FLAG_ZLIB
+#define COMPRESSION_NAME "zlib"
+#else
+#define COMPRESSION_FLAG 0                                                      /* Built without a compressor, so compression is never offered */
+#define COMPRESSION_NAME "none"
+#endif
+
+#define RANGE_SIZE 16                                                           /* Offset (8 bytes) and length or file size (8 bytes) of a range request */
+
+int transferMode = MODE_SENDFILE;                                               /* How files are sent, set with the -m option */
+unsigned long long maxUploadSize = 0;                                           /* Largest file client may upload, set in megabytes with the -U option. 0 disables uploads */
+unsigned long long uploadRate = 0;                                              /* Bytes per second each upload may use, set in megabytes with the -R option. 0 for no limit */
+size_t copyBufferSize = 64 * 1024;                                              /* Size of the read()/send() buffer used by the copy mode, set with the -B option */
+int prefetchThreads = PREFETCH_THREADS;                                         /* Threads that read cold files into the page cache, 0 to read them in the workers */
+int prefetchProbes = 1;                                                         /* The file system reports with RWF_NOWAIT whether a read would block. Cleared by any worker, so accessed atomically */
+int cachestatProbes = 1;                                                        /* The kernel has cachestat(), which counts the cached pages of a window without reading it. Accessed atomically */
+uint32_t checksumTable[8][256];                                                 /* Tables for the software CRC32C, which processes 8 bytes at a time */
+uint32_t (*updateChecksum)(uint32_t checksum, const unsigned char *data, size_t length);    /* Hardware CRC32C if the CPU supports SSE4.2, software otherwise */
+
+enum connectionState {
+    STATE_PORT,                                                                 /* Waiting for the data port number sent by client */
+    STATE_COMMAND,                                                              /* Waiting for the command sent by client */
+    STATE_HOST,                                                                 /* Waiting for the host name (IP address) sent by client */
+    STATE_FILENAME,                                                             /* Waiting for the file name that accompanies the "-g" command */
+    STATE_REQUEST,                                                              /* Version 2: waiting for the next frame sent by client */
+    STATE_CONNECTING,                                                           /* Opening the TCP data connection back to client */
+    STATE_SENDING,                                                              /* Streaming the directory or file contents to client */
+    STATE_CLOSING                                                               /* Waiting for the final control message to be flushed before closing */
+};
+
+struct connection;
+struct worker;
+
+struct fileInfo {                                                               /* What the directory index knows about a file */
+    off_t size;
+    struct timespec mtime;
+    ino_t inode;
+};
+
+struct indexEntry {                                                             /* One regular file in the directory index */
+    struct indexEntry *next;                                                    /* Next entry in the same hash bucket */
+    uint64_t hash;
+    unsigned long long seen;                                                    /* Scan that last found the file, used to drop files that disappeared */
+    struct fileInfo info;
+    int hasChecksum;                                                            /* The CRC32C of the whole file is known for this inode, mtime and size */
+    uint32_t checksum;
+    size_t nameLength;
+    char name[];
+};
+
+struct listing {                                                                /* Directory listing serialized for one protocol version, shared by every transfer that sends it */
+    int references;
+    unsigned long long generation;                                              /* Index generation the listing was built from */
+    size_t length;
+    char data[];
+};
+
+struct directoryIndex {                                                         /* Hash table of the regular files in the current directory, shared by all workers */
+    pthread_rwlock_t lock;                                                      /* Request handlers read the index, the watcher thread changes it */
+    struct indexEntry **buckets;
+    size_t bucketCount;                                                         /* Always a power of two */
+    size_t entryCount;
+    unsigned long long generation;                                              /* Incremented on every change to the index */
+    unsigned long long scan;                                                    /* Number of full scans of the directory */
+    pthread_mutex_t listingLock;
+    struct listing *listings[PROTOCOL_VERSION + 1];                             /* Latest listing for each protocol version */
+    int inotifyFD;
+    pthread_t thread;
+};
+
+struct directoryIndex directoryIndex;
+
+struct cachedFile {                                                             /* File kept open by the hot-file cache */
+    int references;                                                             /* Transfers sending the file, plus one while it is in the cache */
+    int referenced;                                                             /* CLOCK bit: set on every hit and cleared as the hand passes */
+    int cached;                                                                 /* The file is still in the cache, and not evicted or replaced by a newer version */
+    int fd;
+    struct fileInfo key;                                                        /* Inode, mtime and size of the file when it was opened */
+    void *map;                                                                  /* The whole file mapped read-only, or NULL */
+    int mapTried;
+    uint64_t hash;                                                              /* hashName() of the name, compared before the name itself */
+    struct cachedFile *next;                                                    /* Next cached file in the same bucket */
+    size_t slot;                                                                /* Slot the file occupies while it is cached */
+    char name[NAME_MAX + 1];
+};
+
+struct fileCache {                                                              /* Open descriptors and mappings of recently sent files, shared by all workers */
+    pthread_mutex_t lock;
+    struct cachedFile **slots;                                                  /* Ring of cached files swept by the CLOCK hand */
+    size_t slotCount;                                                           /* Budget of open files */
+    struct cachedFile **buckets;                                                /* Cached files chained by the hash of their names */
+    size_t bucketCount;                                                         /* Always a power of two, at least slotCount */
+    size_t hand;
+    size_t mappedBytes;
+    size_t mapBudget;                                                           /* Budget of mapped bytes */
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+};
+
+struct fileCache fileCache = { .lock = PTHREAD_MUTEX_INITIALIZER, .slotCount = CACHED_FILES, .mapBudget = (size_t)CACHED_MEGABYTES << 20 };
+struct prefetch {                                                               /* Window of a file being read into the page cache so that a worker never waits for the disk */
+    struct prefetch *next;
+    struct connection *conn;                                                    /* Connection whose transfer waits for the window */
+    struct cachedFile *file;                                                    /* Reference held until the window has been read */
+    off_t offset;
+    size_t length;
+    size_t done;                                                                /* Bytes of the window read so far */
+    int slot;                                                                   /* Registered io_uring buffer the window is read into, or -1 */
+};
+
+struct prefetchPool {                                                           /* Threads that read windows for the workers when io_uring is not used */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct prefetch *head;
+    struct prefetch *tail;
+};
+
+struct prefetchPool prefetchPool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+volatile sig_atomic_t reportRequested = 0;                                      /* Set by SIGUSR1 to print the hot-file cache counters */
+
+struct logger {                                                                 /* Log lines queued by every thread and written out by the logger thread, so that no worker waits on the terminal */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char pending[LOG_BUFFER_SIZE];
+    size_t length;
+    long long second;                                                           /* Second of the monotonic clock the rate limit is counting lines for */
+    int lines;                                                                  /* Lines accepted during that second */
+    unsigned long long dropped;                                                 /* Lines dropped since the server started */
+    unsigned long long droppedReported;
+};
+
+struct logger logger = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+struct histogram {                                                              /* Bucket i counts the values of at most 2^i, the last bucket also counts everything larger */
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+};
+
+struct metrics {                                                                /* Counters of one worker thread. Only the worker writes them, so they need no lock, and the stats request reads them with atomic loads */
+    unsigned long long connections;                                             /* TCP control connections accepted */
+    unsigned long long closed;                                                  /* TCP control connections closed */
+    unsigned long long requests[REQUEST_KINDS];
+    unsigned long long failures[FAILURE_KINDS];
+    unsigned long long sentBytes;                                               /* Bytes of listings, frames and file contents sent */
+    unsigned long long files;                                                   /* Files sent in full */
+    unsigned long long receivedBytes;                                           /* Bytes of uploaded file contents received */
+    unsigned long long uploads;                                                 /* Uploaded files stored */
+    struct histogram firstByte;                                                 /* Microseconds from the request, or from accept() for the first request of a connection, until its first byte was sent */
+    struct histogram transferRate;                                              /* Bytes per second of each file sent */
+} __attribute__((aligned(64)));                                                 /* Keep the counters of different workers on different cache lines */
+
+struct histogram scanTimes;                                                     /* Microseconds taken by each full scan of the directory, written by the thread that scans */
+
+struct channel {                                                                /* Registered with epoll so that an event can be traced back to its socket and connection */
+    int fd;
+    int kind;
+    struct connection *conn;
+    struct worker *owner;
+};
+
+struct frameHeader {                                                            /* Fixed header that starts every version 2 frame */
+    int version;
+    int opcode;
+    unsigned int flags;
+    size_t length;                                                              /* Number of payload bytes that follow the header */
+    unsigned long long value;                                                   /* File size or other number that goes with the opcode */
+};
+
+struct byteBuffer {                                                             /* Heap buffer that grows as bytes are appended */
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct listLevel {                                                              /* Directory open during a streaming listing */
+    int fd;
+    off_t position;                                                             /* getdents64() offset after the last entry read from the directory */
+    size_t pathLength;                                                          /* Length of the directory's path, with its trailing '/', in the walk's path */
+};
+
+struct listWalk {                                                               /* Streaming listing: the directories being read, so that records are sent as the directory is read */
+    struct listLevel levels[LIST_DEPTH];
+    int depth;                                                                  /* Directories open, 0 once the whole listing has been read */
+    int details;
+    int recursive;
+    int finished;                                                               /* The end frame has been added to the head */
+    unsigned long long limit;                                                   /* Records to send before stopping with a cursor, or 0 for no limit */
+    unsigned long long sent;                                                    /* Records sent so far */
+    size_t entriesLength;
+    size_t entriesNext;                                                         /* Offset of the next entry to handle in entries */
+    size_t prefixLength;
+    char prefix[PATH_MAX];                                                      /* Only paths that start with the prefix are sent */
+    char path[PATH_MAX];                                                        /* Path of the current entry, relative to the served directory */
+    char entries[LIST_READ_SIZE] __attribute__((aligned(8)));                   /* Entries returned by the last getdents64() call */
+};
+
+struct transfer {                                                               /* Everything that is sent for one request: head, then file, then tail */
+    int overControl;                                                            /* Single-connection mode: sent over the TCP control connection */
+    int socketFD;                                                               /* Socket the transfer is sent over */
+    struct byteBuffer head;                                                     /* Sent before the file contents (the file frame) */
+    size_t headSent;
+    struct listing *listing;                                                    /* Directory listing sent after the head, if there is one */
+    struct listWalk *walk;                                                      /* Streaming listing whose next records are built into the head, if there is one */
+    size_t listingSent;
+    struct cachedFile *file;                                                    /* File sent after the head, or NULL if there is no file */
+    int fileFD;                                                                 /* Descriptor of the file, or -1 if there is no file */
+    int mode;                                                                   /* Starts as transferMode and falls back to splice() or copying if needed */
+    int seekable;                                                               /* Regular files are read at fileOffset, other sources are read in order */
+    off_t fileOffset;
+    off_t fileEnd;                                                              /* Offset the file is sent up to, or -1 to send until the end of the file */
+    int pipeFDs[2];                                                             /* Pipe that splice() moves file pages through on their way to the socket */
+    size_t piped;                                                               /* Bytes in the pipe that have not been sent yet */
+    char *buffer;                                                               /* Chunk of the file that has been read but not yet sent by the copy mode */
+    size_t bufferLength;
+    size_t bufferSent;
+    off_t residentEnd;                                                          /* The file is known to be in the page cache up to this offset */
+    off_t startOffset;                                                          /* Offset the file is sent from */
+    int wholeFile;                                                              /* The whole file is being sent, not a range of it */
+    long long startedNs;                                                        /* When the file was set up for sending, or 0 if there is no file */
+    int announcing;                                                             /* The file frame waits until the first window of the file is in the page cache and a sample of it can be compressed */
+    off_t announcedSize;                                                        /* Size of the whole file, for the file frame */
+    int compression;                                                            /* Compression flag the file contents are sent with, or 0 if they are sent as they are */
+    char *rawBlock;                                                             /* Chunk of the file being compressed */
+    char *block;                                                                /* Block frame being sent: the frame header, then the compressed chunk */
+    size_t blockLength;
+    size_t blockSent;
+    long long rawBytes;                                                         /* File contents compressed so far */
+    long long wireBytes;                                                        /* Block frames those contents were sent as */
+    long long compressNs;                                                       /* CPU time spent compressing */
+    int checksumming;                                                           /* The checksum of the file contents is being computed as they are sent */
+    uint32_t checksum;                                                          /* CRC32C of the file contents sent so far */
+    int cacheChecksum;                                                          /* The whole file is being sent, so its checksum can be kept in the directory index */
+    struct fileInfo checksumKey;                                                /* Inode, mtime and size of the file the checksum belongs to */
+    char *checksumBuffer;                                                       /* File contents read back to checksum what sendfile() and splice() sent */
+    int corked;                                                                 /* TCP_CORK is set on the TCP data connection while the transfer runs */
+    int uploading;                                                              /* The transfer receives the file from client into fileFD, up to fileEnd */
+    int throttled;                                                              /* The upload waits on the retry list until it may use more bandwidth */
+    int tempNamed;                                                              /* The upload is written under tempName, otherwise into an unnamed O_TMPFILE file */
+    char tempName[32];
+    off_t syncedTo;                                                             /* Writeback of the upload has been started up to here */
+    char endFrame[FRAME_HEADER_SIZE];                                           /* End frame client sends after the uploaded contents */
+    size_t endReceived;
+    char tail[FRAME_HEADER_SIZE];                                               /* Marker sent last ("EOD", "EOF" or an end frame) */
+    size_t tailLength;
+    size_t tailSent;
+};
+
+struct connection {
+    struct channel control;                                                     /* TCP control connection accepted from client */
+    struct channel data;                                                        /* TCP data connection opened back to client */
+    int state;
+    int closed;
+    int version;                                                                /* Protocol version spoken by client, 1 or 2 */
+    char portNum[BUFFER_SIZE];
+    char command[BUFFER_SIZE];
+    char hostName[BUFFER_SIZE];
+    char fileName[NAME_MAX + 1];
+    int ranged;                                                                 /* Version 2: only part of the file was requested */
+    uint64_t rangeOffset;
+    uint64_t rangeLength;                                                       /* 0 for the rest of the file */
+    uint64_t uploadSize;                                                        /* Size of the file client announced for an upload */
+    int compressions;                                                           /* Compression flags client can decompress */
+    int verify;                                                                 /* Client wants the checksum of the file contents */
+    struct byteBuffer batch;                                                    /* Batch request: names of the files to send, each followed by '\0' */
+    size_t batchNext;                                                           /* Offset of the next name to send in the batch */
+    long batchCount;
+    struct byteBuffer input;                                                    /* Version 2 frames received on the TCP control connection but not handled yet */
+    struct byteBuffer output;                                                   /* Control messages waiting to be sent to client */
+    size_t outputSent;
+    struct addrinfo *dataAddress;
+    int connectAttempts;
+    long long retryAt;
+    struct connection *next;                                                    /* Link used by the worker's retry and closed lists */
+    struct connection *readyNext;                                               /* Link used by the worker's ready list */
+    int ready;
+    int prefetching;                                                            /* The transfer waits for a prefetch, which holds on to the connection */
+    long requests;                                                              /* Requests received on the connection */
+    long long requestedNs;                                                      /* When the current request was received, or 0 once its first byte has been sent */
+    struct transfer transfer;
+};
+
+#ifdef USE_IO_URING
+struct ring {                                                                   /* io_uring instance a worker reads cold files with */
+    int fd;                                                                     /* -1 if io_uring could not be set up, in which case the prefetch threads are used */
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;                                                            /* Entries queued since the last io_uring_enter() */
+    char *buffers;                                                              /* RING_BUFFERS registered buffers of PREFETCH_CHUNK bytes */
+    struct prefetch *slots[RING_BUFFERS];
+    struct prefetch *waiting;                                                   /* Prefetches waiting for a free buffer */
+    struct prefetch *waitingTail;
+};
+#endif
+
+struct worker {
+    int id;
+    int epollFD;
+    struct channel listener;                                                    /* Each worker owns a SO_REUSEPORT listening socket bound to the same port */
+    pthread_t thread;
+    struct connection *retryList;                                               /* Connections waiting to retry the TCP data connection */
+    struct connection *closedList;                                              /* Connections closed during the current batch of events, freed after the batch */
+    struct connection *readyList;                                               /* Connections that used up their budget while the socket was still writable */
+    struct channel wake;                                                        /* Eventfd signalled when a prefetch of this worker has completed */
+    pthread_mutex_t doneLock;
+    struct prefetch *doneList;                                                  /* Completed prefetches, pushed by the prefetch threads */
+#ifdef USE_IO_URING
+    struct ring ring;
+#endif
+    struct metrics metrics;
+};
+
+struct worker *workerList;                                                      /* Every worker, so that a stats request can add up their counters */
+int workerCount;
+
+/****************************************************************
+* Name: logMessage()
+* Description: This function receives a printf() format and its arguments and queues the line for the logger thread, which writes it
+*               to standard output. The caller only formats the line and copies it under a lock, so a worker never waits for the
+*               terminal or a pipe. At most LOG_LINES_PER_SECOND lines are accepted per second; lines beyond that, or lines that do not
+*               fit in the buffer, are dropped and counted, and the number dropped is logged once the next second starts.
+* Resources used: http://man7.org/linux/man-pages/man3/vsnprintf.3.html
+****************************************************************/
+void logMessage(const char *format, ...){
+    char line[LOG_LINE_SIZE];
+    struct timespec now;
+    va_list arguments;
+    int length = 0;
+    int wasEmpty = 0;
+
+    va_start(arguments, format);
+    length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if(length < 0){
+        return;
+    }
+    if((size_t)length >= sizeof(line)){                                         /* Cut the line short but keep its newline */
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);                                /* Only the second is needed, and the coarse clock is the cheapest to read */
+
+    pthread_mutex_lock(&logger.lock);
+    wasEmpty = logger.length == 0;
+    if(now.tv_sec != logger.second){                                            /* A new second, so report what the last one dropped */
+        logger.second = now.tv_sec;
+        logger.lines = 0;
+        if(logger.dropped != logger.droppedReported && logger.length + LOG_LINE_SIZE <= sizeof(logger.pending)){
+            logger.length += snprintf(logger.pending + logger.length, LOG_LINE_SIZE, "%llu log messages dropped.\n", logger.dropped - logger.droppedReported);
+            logger.droppedReported = logger.dropped;
+        }
+    }
+    if(logger.lines >= LOG_LINES_PER_SECOND || logger.length + length > sizeof(logger.pending)){
+        logger.dropped++;
+    }
+    else{
+        memcpy(logger.pending + logger.length, line, length);
+        logger.length += length;
+        logger.lines++;
+    }
+    if(wasEmpty && logger.length != 0){                                         /* The logger thread sleeps while there is nothing to write */
+        pthread_cond_signal(&logger.wake);
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/****************************************************************
+* Name: writeLog()
+* Description: This function receives a buffer of log lines and its length as arguments and writes it to standard output.
+****************************************************************/
+void writeLog(const char *lines, size_t length){
+    while(length > 0){
+        ssize_t written = write(STDOUT_FILENO, lines, length);
+
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){                                                       /* Nowhere to write the log, so drop it */
+            return;
+        }
+        lines += written;
+        length -= written;
+    }
+}
+
+/****************************************************************
+* Name: flushLog()
+* Description: This function writes out the log lines that the logger thread has not written yet. It is called before the server exits.
+****************************************************************/
+void flushLog(void){
+    pthread_mutex_lock(&logger.lock);
+    writeLog(logger.pending, logger.length);
+    logger.length = 0;
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/****************************************************************
+* Name: runLogger()
+* Description: This function is the entry point of the logger thread. It waits for log lines, takes everything that has been queued
+*               in one go and writes it to standard output without holding the lock, so the other threads keep logging meanwhile.
+****************************************************************/
+void *runLogger(void *arg){
+    static char lines[LOG_BUFFER_SIZE];
+    size_t length = 0;
+
+    (void)arg;
+    while(1){
+        pthread_mutex_lock(&logger.lock);
+        while(logger.length == 0){
+            pthread_cond_wait(&logger.wake, &logger.lock);
+        }
+        length = logger.length;
+        memcpy(lines, logger.pending, length);
+        logger.length = 0;
+        pthread_mutex_unlock(&logger.lock);
+
+        writeLog(lines, length);
+    }
+
+    return NULL;
+}
 
 void error(const char *msg){                                                    /* Error function used for reporting issues */
-    perror(msg); 
-    exit(1); 
-} 
+    flushLog();                                                                 /* Write out what was logged before the error */
+    perror(msg);
+    exit(1);
+}
 
-/**************************************************************** 
+/****************************************************************
 * Name: getAddressInfo()
-* Description: This function receives the server port number as an argument in order to get the address information. It sets 
-*               up the hints address info stucture, which is passed to the getaddrinfo() function. The getaddrinfo() function 
-*               allocates and initalizes a linked list of addrinfo structures, one for each network address, each of which contains 
-*               an address that can be specified in a call to bind or connect. If the call to the getaddrinfo() function is successful, 
+* Description: This function receives the server port number as an argument in order to get the address information. It sets
+*               up the hints address info stucture, which is passed to the getaddrinfo() function. The getaddrinfo() function
+*               allocates and initalizes a linked list of addrinfo structures, one for each network address, each of which contains
+*               an address that can be specified in a call to bind or connect. If the call to the getaddrinfo() function is successful,
 *               result will contain a pointer to the start of the list addrinfo structures. This function will return a pointer to the
 *               addrinfo structure back to main.
 * Resources used: https://docs.microsoft.com/en-us/windows/win32/api/ws2def/ns-ws2def-addrinfoa
@@ -43,7 +592,7 @@ struct addrinfo *getAddressInfo(char *portNum){
     hints.ai_flags = AI_PASSIVE;                                                /* Fill in the IP for us */
 
     status = getaddrinfo(NULL, portNum, &hints, &result);                       /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-    
+
     if(status != 0){                                                            /* Print out an error message and exit if the call to the getaddrinfo() function was unsuccessful */
         error("Erroneous port number.\n");
     }
@@ -51,34 +600,34 @@ struct addrinfo *getAddressInfo(char *portNum){
     return result;                                                              /* Return the response information */
 }
 
-/**************************************************************** 
+/****************************************************************
 * Name: createSocket()
-* Description: This function receives a pointer to the addrinfo structure as an argument. This function will call the socket() function to 
-*               create a socket, which will return a socket file descriptor. This function will return the socket file descriptor 
-*               back to main.
+* Description: This function receives a pointer to the addrinfo structure as an argument. This function will call the socket() function to
+*               create a non-blocking socket, which will return a socket file descriptor. This function will return the socket file
+*               descriptor back to the caller, or -1 if the socket could not be created.
 *Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
 *                   https://beej.us/guide/bgnet/html/multi/clientserver.html
+*                   http://man7.org/linux/man-pages/man2/socket.2.html
 ****************************************************************/
 int createSocket(struct addrinfo *getInfo){
     int status = 0;
 
-    status = socket(getInfo->ai_family, getInfo->ai_socktype, getInfo->ai_protocol);    /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-    
-    if(status == -1){                                                           /* Print out an error message and exit if the call to the socket() function was unsuccessful */
-        error("Error in creating socket.\n");
+    status = socket(getInfo->ai_family, getInfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, getInfo->ai_protocol);    /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+
+    if(status == -1){                                                           /* Print out an error message if the call to the socket() function was unsuccessful */
+        logMessage("Error in creating socket: %s\n", strerror(errno));
     }
 
     return status;                                                              /* Return the socket file descriptor */
 }
 
-/**************************************************************** 
+/****************************************************************
 * Name: getNewAddressInfo()
-* Description: This function receives the client address and client port number as arguments in order to get the address information. It sets 
-*               up the hints address info stucture, which is passed to the getaddrinfo() function. The getaddrinfo() function 
-*               allocates and initalizes a linked list of addrinfo structures, one for each network address, each of which contains 
-*               an address that can be specified in a call to bind or connect. If the call to the getaddrinfo() function is successful, 
-*               result will contain a pointer to the start of the list addrinfo structures. This function will return a pointer to the
-*               addrinfo structure back to main.
+* Description: This function receives the client address and client port number as arguments in order to get the address information. It sets
+*               up the hints address info stucture, which is passed to the getaddrinfo() function. The client sends its IP address, so
+*               the address is first resolved numerically, which avoids a blocking DNS lookup in the event loop, and is only resolved
+*               as a host name if that fails. This function will return a pointer to the addrinfo structure back to the caller, or NULL
+*               if the address could not be resolved.
 * Resources used: https://docs.microsoft.com/en-us/windows/win32/api/ws2def/ns-ws2def-addrinfoa
 *                   https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
 *                   https://beej.us/guide/bgnet/html/multi/clientserver.html
@@ -92,313 +641,4012 @@ struct addrinfo *getNewAddressInfo(char *inAdd, char *portNum){
     memset(&hints, 0, sizeof hints);                                            /* Ensure that the struct is empty */
     hints.ai_family = AF_INET;                                                  /* Designated IP v4 as the address family that this socket can communicate with */
     hints.ai_socktype = SOCK_STREAM;                                            /* TCP stream socket */
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;                           /* Client sends a dotted IP address, so no resolver call is needed */
 
     status = getaddrinfo(inAdd, portNum, &hints, &result);                      /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-    
-    if(status != 0){                                                            /* Print out an error message and exit if the call to the getaddrinfo() function was unsuccessful */
-        error("Error in getting address.\n");
+
+    if(status != 0){                                                            /* Fall back to resolving the address as a host name */
+        hints.ai_flags = 0;
+        status = getaddrinfo(inAdd, portNum, &hints, &result);
+    }
+
+    if(status != 0){                                                            /* Print out an error message if the call to the getaddrinfo() function was unsuccessful */
+        logMessage("Error in getting address %s: %s\n", inAdd, gai_strerror(status));
+        return NULL;
     }
 
     return result;                                                              /* Return the response information */
 }
 
-/**************************************************************** 
+/****************************************************************
 * Name: connectToSocket()
-* Description: This function receives a socket file descriptor and a pointer to the addrinfo structure as arguments. This function 
-*               will call the connect() function to create a connection. This function will not return any values back to main.
-* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo 
+* Description: This function receives a socket file descriptor and a pointer to the addrinfo structure as arguments. This function
+*               will call the connect() function to start a connection on the non-blocking socket. This function will return 0 if the
+*               connection was established immediately, 1 if the connection is in progress and -1 if it failed.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+*                   http://man7.org/linux/man-pages/man2/connect.2.html
 ****************************************************************/
-void connectToSocket(int socketFD, struct addrinfo *getInfo){
+int connectToSocket(int socketFD, struct addrinfo *getInfo){
     int status = 0;
 
     status = connect(socketFD, getInfo->ai_addr, getInfo->ai_addrlen);          /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-    
+
     if(status == -1){
-        error("Error connecting.\n");
+        if(errno == EINPROGRESS){                                               /* The connection will complete once the socket becomes writable */
+            return 1;
+        }
+        return -1;
     }
+
+    return 0;
 }
 
-/**************************************************************** 
-* Name: handleRequest()
-* Description: This function receives a socket file descriptor and will handle the request that is sent by the client program.
-*               Once the TCP control connection has been established, the server program will wait for the client program
-*               to send a command, which will be accompanied by the port that will server as the TCP data connection. This function
-*               will assess the data that is sent by the client program to either send a list of the files in the current directory,
-*               send the contents of a file that matches the file name sent by the client program or send an appropriate error message. 
-*               The function will also close the TCP data connection once the applicable information has been sent to client. This 
-*               function will not return any values back to main.
-* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo 
-*                   https://www.gnu.org/software/libc/manual/html_node/Directory-Entries.html 
-*                   https://www.geeksforgeeks.org/c-program-list-files-sub-directories-directory/
-*                   http://pubs.opengroup.org/onlinepubs/7990989775/xsh/readdir.html
-*                   https://www.geeksforgeeks.org/input-output-system-calls-c-create-open-close-read-write/ 
-*                   https://stackoverflow.com/questions/2014033/send-and-receive-a-file-in-socket-programming-in-linux-with-c-c-gcc-g
+/****************************************************************
+* Name: currentTimeMs()
+* Description: This function returns the current time of the monotonic clock in milliseconds. It is used to schedule the retries
+*               of the TCP data connection.
+* Resources used: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
 ****************************************************************/
-void handleRequest(int new_socketFD){
-    char portNum[BUFFER_SIZE];
-    char command[BUFFER_SIZE];
-    char hostName[BUFFER_SIZE];
-    char fileName[BUFFER_SIZE];   
-    char *commandError = "CE";
-    char *fileError = "FE";
-    char *noCommandError = "NCE";
-    char *noFileError = "NFE";
-    char *noError = "NE";
-    char *endOfDirectory = "EOD";
-    char *endOfFile = "EOF";
-    int charsWritten, charsRead;
-    int directoryCount = 0;
-    int fileCount = 0;
-    int matchingFile = 0;
-    int newestSocketFD;
-    int writtenStatus = 0;
-    int readStatus = 0;
-    int i = 0;
+long long currentTimeMs(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/****************************************************************
+* Name: currentTimeNs()
+* Description: This function returns the current time of the monotonic clock in nanoseconds. It is used to time requests and transfers.
+* Resources used: http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+****************************************************************/
+long long currentTimeNs(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/****************************************************************
+* Name: countMetric()
+* Description: This function receives a counter and an amount as arguments and adds the amount to the counter. Every counter has a
+*               single writer, the worker or thread it belongs to, so a relaxed load and store are enough and no locked instruction is
+*               needed. Readers use relaxed loads, so they never see a torn value.
+* Resources used: https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+****************************************************************/
+void countMetric(unsigned long long *counter, unsigned long long amount){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/****************************************************************
+* Name: recordHistogram()
+* Description: This function receives a histogram and a value as arguments and counts the value in the bucket of the smallest power of
+*               two that is at least the value.
+****************************************************************/
+void recordHistogram(struct histogram *histogram, unsigned long long value){
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+
+    if(bucket >= HISTOGRAM_BUCKETS){
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    countMetric(&histogram->buckets[bucket], 1);
+    countMetric(&histogram->count, 1);
+    countMetric(&histogram->sum, value);
+}
+
+/****************************************************************
+* Name: watchChannel()
+* Description: This function receives a worker, a channel and the epoll events to watch as arguments. It registers the channel's
+*               socket with the worker's epoll instance in edge-triggered mode. This function will return 0 if successful and -1 otherwise.
+* Resources used: http://man7.org/linux/man-pages/man7/epoll.7.html
+****************************************************************/
+int watchChannel(struct worker *owner, struct channel *chan, unsigned int events){
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events | EPOLLET;                                            /* Edge-triggered, so each handler must read or write until EAGAIN */
+    event.data.ptr = chan;
+
+    return epoll_ctl(owner->epollFD, EPOLL_CTL_ADD, chan->fd, &event);
+}
+
+/****************************************************************
+* Name: reserveBytes()
+* Description: This function receives a byte buffer and a number of bytes as arguments. It makes sure that the buffer has room for
+*               that many more bytes, doubling its capacity until they fit. This function will return 0 if successful and -1 otherwise.
+****************************************************************/
+int reserveBytes(struct byteBuffer *buffer, size_t length){
+    if(buffer->length + length > buffer->capacity){
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        char *grown;
+
+        while(capacity < buffer->length + length){
+            capacity *= 2;
+        }
+        grown = realloc(buffer->data, capacity);
+        if(grown == NULL){
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
 
-    /* Receive message from client to set up handshake for TCP connection */
-    memset(portNum, 0, sizeof(portNum));                                        /* Ensure that the portNum array is empty */
-    charsRead = recv(new_socketFD, portNum, sizeof(portNum) - 1, 0);            /* Read data from the socket */
+    return 0;
+}
 
-    if (charsRead < 0){
-        error("ERROR reading from socket");
+/****************************************************************
+* Name: appendBytes()
+* Description: This function receives a byte buffer, a pointer to some bytes and their length as arguments. It appends the bytes to
+*               the buffer, growing it if needed. This function will return 0 if successful and -1 otherwise.
+****************************************************************/
+int appendBytes(struct byteBuffer *buffer, const void *bytes, size_t length){
+    if(reserveBytes(buffer, length) == -1){
+        return -1;
     }
 
-    /* Send message to client to set up handshake for TCP connection */
-    charsWritten = send(new_socketFD, noError, strlen(noError), 0);             /* Write to the client */
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
 
-    if (charsWritten < 0){
-        error("ERROR writing to socket");
+    return 0;
+}
+
+/****************************************************************
+* Name: encodeFrameHeader()
+* Description: This function receives an output array and the fields of a version 2 frame header as arguments, and writes the
+*               FRAME_HEADER_SIZE byte header in network byte order: version (1 byte), opcode (1 byte), flags (2 bytes), payload
+*               length (4 bytes) and value (8 bytes).
+* Resources used: http://man7.org/linux/man-pages/man3/endian.3.html
+****************************************************************/
+void encodeFrameHeader(char *out, int opcode, unsigned int flags, size_t length, unsigned long long value){
+    uint16_t flagBytes = htobe16((uint16_t)flags);
+    uint32_t lengthBytes = htobe32((uint32_t)length);
+    uint64_t valueBytes = htobe64(value);
+
+    out[0] = PROTOCOL_VERSION;
+    out[1] = (char)opcode;
+    memcpy(out + 2, &flagBytes, sizeof(flagBytes));
+    memcpy(out + 4, &lengthBytes, sizeof(lengthBytes));
+    memcpy(out + 8, &valueBytes, sizeof(valueBytes));
+}
+
+/****************************************************************
+* Name: decodeFrameHeader()
+* Description: This function receives FRAME_HEADER_SIZE bytes and a frame header structure as arguments, and fills in the structure
+*               from the bytes. It is the reverse of encodeFrameHeader().
+****************************************************************/
+void decodeFrameHeader(const char *in, struct frameHeader *header){
+    uint16_t flagBytes;
+    uint32_t lengthBytes;
+    uint64_t valueBytes;
+
+    memcpy(&flagBytes, in + 2, sizeof(flagBytes));
+    memcpy(&lengthBytes, in + 4, sizeof(lengthBytes));
+    memcpy(&valueBytes, in + 8, sizeof(valueBytes));
+
+    header->version = (unsigned char)in[0];
+    header->opcode = (unsigned char)in[1];
+    header->flags = be16toh(flagBytes);
+    header->length = be32toh(lengthBytes);
+    header->value = be64toh(valueBytes);
+}
+
+/****************************************************************
+* Name: appendFrame()
+* Description: This function receives a byte buffer, the fields of a version 2 frame and its payload as arguments, and appends the
+*               frame to the buffer. This function will return 0 if successful and -1 otherwise.
+****************************************************************/
+int appendFrame(struct byteBuffer *buffer, int opcode, unsigned int flags, unsigned long long value, const void *payload, size_t length){
+    char header[FRAME_HEADER_SIZE];
+
+    encodeFrameHeader(header, opcode, flags, length, value);
+
+    if(appendBytes(buffer, header, sizeof(header)) == -1){
+        return -1;
     }
 
-    /* Receive the command from client in the TCP connection */
-    memset(command, 0, sizeof(command));
-    charsRead = recv(new_socketFD, command, sizeof(command) - 1, 0);            /* Read data from the socket */
+    return appendBytes(buffer, payload, length);
+}
+
+/****************************************************************
+* Name: appendText()
+* Description: This function receives a byte buffer, a printf() format and its arguments as arguments and appends the formatted text to
+*               the buffer, without a terminating '\0'. This function will return 0 if successful and -1 otherwise.
+* Resources used: http://man7.org/linux/man-pages/man3/vsnprintf.3.html
+****************************************************************/
+int appendText(struct byteBuffer *buffer, const char *format, ...){
+    va_list arguments;
+    int length = 0;
+
+    if(reserveBytes(buffer, LOG_LINE_SIZE) == -1){                              /* Every line of text the server builds fits in a log line */
+        return -1;
+    }
 
-    if (charsRead < 0){
-        error("ERROR reading from socket");
+    va_start(arguments, format);
+    length = vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, arguments);
+    va_end(arguments);
+    if(length < 0 || (size_t)length >= buffer->capacity - buffer->length){
+        return -1;
     }
+    buffer->length += length;
+
+    return 0;
+}
+
+/****************************************************************
+* Name: updateChecksumSoftware()
+* Description: This function receives a CRC32C checksum, data and its length as arguments and returns the checksum updated with the
+*               data. It uses the slicing-by-8 tables built by startChecksums(), which process 8 bytes per step.
+* Resources used: https://www.ietf.org/rfc/rfc3720.txt (Section 12.1)
+*                   https://create.stephan-brumme.com/crc32/#slicing-by-8-overview
+****************************************************************/
+uint32_t updateChecksumSoftware(uint32_t checksum, const unsigned char *data, size_t length){
+    uint32_t crc = ~checksum;
 
-    send(new_socketFD, noError, strlen(noError), 0);                            /* Write to client to inform it that no errors have occurred thus far */
+    while(length >= 8){
+        uint64_t word;
+        uint32_t high;
 
-    /* Receive the hostName from client in the TCP connection */
-    memset(hostName, 0, sizeof(hostName));
-    charsRead = recv(new_socketFD, hostName, sizeof(hostName) - 1, 0);          /* Read data from the socket */
+        memcpy(&word, data, sizeof(word));
+        word = le64toh(word);
+        crc ^= (uint32_t)word;
+        high = (uint32_t)(word >> 32);
+        crc = checksumTable[7][crc & 0xff] ^ checksumTable[6][(crc >> 8) & 0xff] ^ checksumTable[5][(crc >> 16) & 0xff] ^ checksumTable[4][crc >> 24] ^
+              checksumTable[3][high & 0xff] ^ checksumTable[2][(high >> 8) & 0xff] ^ checksumTable[1][(high >> 16) & 0xff] ^ checksumTable[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
 
-    if (charsRead < 0){
-        error("ERROR reading from socket");
+    while(length-- > 0){
+        crc = (crc >> 8) ^ checksumTable[0][(crc ^ *data++) & 0xff];
     }
 
-    printf("Connection from flip2 at %s.\n", hostName);
+    return ~crc;
+}
 
-    if(strcmp(command, "l") == 0){                                              /* If statement to assess whether the command sent by client was "-l" */
-        send(new_socketFD, noCommandError, strlen(noCommandError), 0);          /* Write to client to inform it that the command that was sent was successfully received */
-        printf("List directory requested on port %s.\n", portNum);
-        printf("Sending directory contents to flip2 at %s: %s\n", hostName, portNum);
+#if defined(__x86_64__)
+/****************************************************************
+* Name: updateChecksumHardware()
+* Description: This function does the same as updateChecksumSoftware() with the SSE4.2 crc32 instruction, which processes 8 bytes
+*               per instruction.
+* Resources used: https://www.felixcloutier.com/x86/crc32
+****************************************************************/
+__attribute__((target("sse4.2"))) uint32_t updateChecksumHardware(uint32_t checksum, const unsigned char *data, size_t length){
+    uint64_t crc = ~checksum;
 
-        char **directoryArray = malloc(BUFFER_SIZE*sizeof(char *));             /* Create and allocate memory for a pointer to a pointer to directoryArray char in order to hold each of the directory file names */
-        
-        for(i = 0; i < BUFFER_SIZE; i++){                                       /* For loop to allocate memory and ensure that each char array pointed to by directoryArray is empty */
-            directoryArray[i] = malloc(BUFFER_SIZE*sizeof(char *));
-            memset(directoryArray[i], 0, sizeof(directoryArray[i]));
-        }
+    while(length >= 8){
+        uint64_t word;
 
-        /* Please note, for this section, I referred to the following resources:
-        *   1) https://www.gnu.org/software/libc/manual/html_node/Directory-Entries.html 
-        *   2) https://www.geeksforgeeks.org/c-program-list-files-sub-directories-directory/
-        *   3) http://pubs.opengroup.org/onlinepubs/7990989775/xsh/readdir.html */
-        struct dirent *de;
-        DIR *dr = opendir(".");                                                 /* opendir returns a pointed of DIR type, which dr will now point to. I referenced #2 above */
-        if(dr != NULL){
-            while((de = readdir(dr)) != NULL){                                  /* readdir() returns a pointer to a structre representing the directory entry at the current position in the director stream. I referenced #2 above */
-                if(de->d_type == DT_REG){                                       /* Verify if the current position pointed to is a regular file in the directory. I referenced #1 above */
-                    strcpy(directoryArray[directoryCount], de->d_name);         /* Copy the name of the file pointed to in the directory into the current element in the directoryArray variable */
-                    directoryCount++;                                           /* Increment the variable holding the number of files in the current directory */
-                }
-            }
-        }
-        closedir(dr);                                                           /* Close the current directory */
+        memcpy(&word, data, sizeof(word));
+        crc = __builtin_ia32_crc32di(crc, word);
+        data += 8;
+        length -= 8;
+    }
 
-        struct addrinfo *newAddInfo1 = getNewAddressInfo(hostName, portNum);    /* Call the getNewAddressInfo() function and return a pointer to newAddrinfo structure */
+    while(length-- > 0){
+        crc = __builtin_ia32_crc32qi((uint32_t)crc, *data++);
+    }
 
-        newestSocketFD = createSocket(newAddInfo1);                             /* Call the createSocket() function to create a socket and return a socket file descriptor */
+    return ~(uint32_t)crc;
+}
+#endif
 
-        connectToSocket(newestSocketFD, newAddInfo1);                           /* Call the connectToSocket() function to set up a connection */
+/****************************************************************
+* Name: startChecksums()
+* Description: This function builds the tables for the software CRC32C and chooses the hardware version instead if the CPU supports
+*               SSE4.2.
+****************************************************************/
+void startChecksums(void){
+    uint32_t i = 0;
+    int j = 0;
 
-        for(i = 0; i < directoryCount; i++){                                    /* For loop to send each of the file names at each position in the directoryArray[] to client */
-            writtenStatus = send(newestSocketFD, directoryArray[i], BUFFER_SIZE, 0);  /* Write to client */
+    for(i = 0; i < 256; i++){
+        uint32_t crc = i;
 
-            if(writtenStatus == -1){
-                error("Error occurred. File name not sent.\n");
-            }
+        for(j = 0; j < 8; j++){
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;                 /* Reversed Castagnoli polynomial */
+        }
+        checksumTable[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++){
+        for(j = 1; j < 8; j++){
+            checksumTable[j][i] = (checksumTable[j - 1][i] >> 8) ^ checksumTable[0][checksumTable[j - 1][i] & 0xff];
         }
+    }
 
-        send(newestSocketFD, endOfDirectory, strlen(endOfDirectory), 0);        /* Inform client that there are no more file names to send */
+    updateChecksum = updateChecksumSoftware;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")){
+        updateChecksum = updateChecksumHardware;
+    }
+#endif
+}
+
+/****************************************************************
+* Name: hashName()
+* Description: This function receives a file name and its length as arguments and returns its 64-bit FNV-1a hash, which is used to
+*               find the file in the directory index.
+* Resources used: http://www.isthe.com/chongo/tech/comp/fnv/index.html
+****************************************************************/
+uint64_t hashName(const char *name, size_t length){
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
 
-        close(newestSocketFD);                                                  /* Close the connection on the socket file descriptor. I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+    for(i = 0; i < length; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
 
-        freeaddrinfo(newAddInfo1);                                              /* Free the linked list allocated by getaddrinfo(). I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+    return hash;
+}
 
-        for(i = 0; i < BUFFER_SIZE; i++){                                       /* Free the memory that was previously allocated to each char array pointed to by the directoryArray */
-            free(directoryArray[i]);
-        }
-        free(directoryArray);                                                   /* Free the memory that was previously allocated for the pointer to a pointer to directoryArray char */
+/****************************************************************
+* Name: findEntry()
+* Description: This function receives a file name, its length and its hash as arguments and returns a pointer to the link that points
+*               to the file's entry in the directory index, so the entry can also be replaced or removed. The link points to NULL if
+*               the file is not in the index. The caller must hold the index lock.
+****************************************************************/
+struct indexEntry **findEntry(const char *name, size_t length, uint64_t hash){
+    struct indexEntry **link = &directoryIndex.buckets[hash & (directoryIndex.bucketCount - 1)];
 
+    while(*link != NULL && !((*link)->hash == hash && (*link)->nameLength == length && memcmp((*link)->name, name, length) == 0)){
+        link = &(*link)->next;
     }
-    else if(strcmp(command, "g") == 0){                                         /* If statement to assess whether the command sent by client was "-g" */
-        send(new_socketFD, noCommandError, strlen(noCommandError), 0);          /* Write to client to inform it that the command that was sent was successfully received */
 
-        memset(fileName, 0, sizeof(fileName));                                  /* Ensure that fileName is empty */
+    return link;
+}
 
-        readStatus = recv(new_socketFD, fileName, sizeof(fileName) - 1, 0);     /* Read data from the socket and assign it to fileName */
+/****************************************************************
+* Name: growIndex()
+* Description: This function doubles the number of hash buckets in the directory index and moves every entry to its new bucket, which
+*               keeps lookups O(1) as the directory grows. The caller must hold the index lock for writing.
+****************************************************************/
+void growIndex(void){
+    size_t bucketCount = directoryIndex.bucketCount * 2;
+    struct indexEntry **buckets = calloc(bucketCount, sizeof(struct indexEntry *));
+    size_t i = 0;
 
-        if(readStatus == -1){
-            error("Error occurred. File name not received.\n");
-        }
+    if(buckets == NULL){                                                        /* Keep the current buckets, which still work, only more slowly */
+        return;
+    }
 
-        printf("File %s requested on port %s.\n", fileName, portNum);
+    for(i = 0; i < directoryIndex.bucketCount; i++){
+        struct indexEntry *entry = directoryIndex.buckets[i];
 
-        char **fileArray = malloc(BUFFER_SIZE*sizeof(char *));                  /* Create and allocate memory for a pointer to a pointer to fileArray char in order to hold each of the file names */
-        
-        for(i = 0; i < BUFFER_SIZE; i++){                                       /* For loop to allocate memory and ensure that each char array pointed to by fileArray is empty */
-            fileArray[i] = malloc(BUFFER_SIZE*sizeof(char *));
-            memset(fileArray[i], 0, sizeof(fileArray[i]));
-        }
+        while(entry != NULL){
+            struct indexEntry *next = entry->next;
 
-        /* Please note, for this section, I referred to the following resources:
-        *   1) https://www.gnu.org/software/libc/manual/html_node/Directory-Entries.html 
-        *   2) https://www.geeksforgeeks.org/c-program-list-files-sub-directories-directory/
-        *   3) http://pubs.opengroup.org/onlinepubs/7990989775/xsh/readdir.html */
-        struct dirent *de;
-        DIR *dr = opendir(".");                                                 /* opendir returns a pointed of DIR type, which dr will now point to. I referenced #2 above */
-        if(dr){
-            while((de = readdir(dr)) != NULL){                                  /* readdir() returns a pointer to a structre representing the directory entry at the current position in the director stream. I referenced #2 above */
-                if(de->d_type == DT_REG){                                       /* Verify if the current position pointed to is a regular file in the directory. I referenced #1 above */
-                    strcpy(fileArray[fileCount], de->d_name);                   /* Copy the name of the file pointed to in the directory into the current element in the fileArray variable */
-                    fileCount++;                                                /* Increment the variable holding the number of files in the current directory */
-                }
-            }
+            entry->next = buckets[entry->hash & (bucketCount - 1)];
+            buckets[entry->hash & (bucketCount - 1)] = entry;
+            entry = next;
         }
-        closedir(dr);                                                           /* Close the current directory */
+    }
 
-        for(i = 0; i < fileCount; i++){                                         /* For loop to compare the file name that was passed to server with the each of the file names that are in the current directory */
-            if(strcmp(fileArray[i], fileName) == 0){
-                matchingFile = 1;                                               /* If one of the file names in the current directory matches the file name that was passed to server, set matchingFile = 1 */
-            }
+    free(directoryIndex.buckets);
+    directoryIndex.buckets = buckets;
+    directoryIndex.bucketCount = bucketCount;
+}
+
+/****************************************************************
+* Name: updateIndex()
+* Description: This function receives a file name as an argument and brings its entry in the directory index up to date. The file is
+*               looked up with fstatat() before the index is locked; if it is a regular file its entry is added or updated, and
+*               otherwise any entry for it is removed. Half-written uploads are left out, so they can never be listed or sent.
+* Resources used: http://man7.org/linux/man-pages/man2/stat.2.html
+****************************************************************/
+void updateIndex(const char *name){
+    struct stat fileStat;
+    int regular = strncmp(name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) != 0 && fstatat(AT_FDCWD, name, &fileStat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(fileStat.st_mode);    /* Only regular files can be listed and requested */
+    size_t length = strlen(name);
+    uint64_t hash = hashName(name, length);
+    struct indexEntry **link;
+
+    pthread_rwlock_wrlock(&directoryIndex.lock);
+    link = findEntry(name, length, hash);
+
+    if(!regular){
+        if(*link != NULL){                                                      /* The file was removed, renamed or replaced by something else */
+            struct indexEntry *removed = *link;
+
+            *link = removed->next;
+            free(removed);
+            directoryIndex.entryCount--;
+            directoryIndex.generation++;
         }
+        pthread_rwlock_unlock(&directoryIndex.lock);
+        return;
+    }
 
-        if(matchingFile){                                                       /* If statement to assess whether one of the files in the current directory matches the file named passed to server */
-            printf("Sending %s to flip2 at %s: %s\n", fileName, hostName, portNum);
+    if(*link == NULL){
+        struct indexEntry *entry = malloc(sizeof(struct indexEntry) + length + 1);
 
-            send(new_socketFD, noFileError, strlen(noFileError), 0);            /* Inform client that server found the file */
+        if(entry == NULL){
+            pthread_rwlock_unlock(&directoryIndex.lock);
+            return;
+        }
+        entry->next = NULL;
+        entry->hash = hash;
+        entry->hasChecksum = 0;
+        memset(&entry->info, 0, sizeof(entry->info));                           /* A new entry has nothing to compare against yet */
+        entry->nameLength = length;
+        memcpy(entry->name, name, length + 1);
+        *link = entry;
+        directoryIndex.entryCount++;
+    }
 
-            struct addrinfo *newAddInfo2 = getNewAddressInfo(hostName, portNum);     /* Call the getNewAddressInfo() function and return a pointer to newAddrinfo structure */
+    if((*link)->info.inode != fileStat.st_ino || (*link)->info.size != fileStat.st_size || (*link)->info.mtime.tv_sec != fileStat.st_mtim.tv_sec || (*link)->info.mtime.tv_nsec != fileStat.st_mtim.tv_nsec){
+        (*link)->hasChecksum = 0;                                               /* The file changed, so its checksum has to be computed again */
+    }
+    (*link)->seen = directoryIndex.scan;
+    (*link)->info.size = fileStat.st_size;
+    (*link)->info.mtime = fileStat.st_mtim;
+    (*link)->info.inode = fileStat.st_ino;
+    directoryIndex.generation++;
 
-            newestSocketFD = createSocket(newAddInfo2);                         /* Call the createSocket() function to create a socket and return a socket file descriptor */
+    if(directoryIndex.entryCount > directoryIndex.bucketCount){                 /* Keep about one entry per bucket */
+        growIndex();
+    }
 
-            connectToSocket(newestSocketFD, newAddInfo2);                       /* Call the connectToSocket() function to set up a connection */
+    pthread_rwlock_unlock(&directoryIndex.lock);
+}
 
-            char buffer[BUFFER_SIZE];
-            memset(buffer, 0, sizeof(buffer));                                  /* Ensure that buffer is empty */
+/****************************************************************
+* Name: scanDirectory()
+* Description: This function reads the current directory and updates the directory index with every file in it. Entries for files
+*               that were not found by the scan are removed afterwards. It builds the index at startup and rebuilds it if inotify
+*               reports that events were lost.
+* Resources used: https://www.gnu.org/software/libc/manual/html_node/Directory-Entries.html
+*                   http://pubs.opengroup.org/onlinepubs/7990989775/xsh/readdir.html
+****************************************************************/
+void scanDirectory(void){
+    struct dirent *de;
+    DIR *dr = opendir(".");                                                     /* opendir returns a pointed of DIR type, which dr will now point to */
+    size_t i = 0;
+    long long startedNs = currentTimeNs();
 
-            int openedFile = open(fileName, O_RDONLY);                          /* Open the file name held by fileName in the current directory and set the file descriptor equal to the returned value */                
-                                                                                /* I utilized: https://www.geeksforgeeks.org/input-output-system-calls-c-create-open-close-read-write/ */
-            /* Please note, for the following while loop section I utilized: https://stackoverflow.com/questions/2014033/send-and-receive-a-file-in-socket-programming-in-linux-with-c-c-gcc-g */
-            while(1){
-                int readBytes = read(openedFile, buffer, sizeof(buffer) - 1);   /* Read data into the buffer and store how many bytes were read in readBytes */
+    if(dr == NULL){
+        logMessage("Unable to read the current directory: %s\n", strerror(errno));
+        return;
+    }
 
-                if(readBytes == 0){                                             /* if readBytes == 0, we are done reading from the file */
-                    break;
-                }
+    pthread_rwlock_wrlock(&directoryIndex.lock);
+    directoryIndex.scan++;
+    pthread_rwlock_unlock(&directoryIndex.lock);
 
-                if(readBytes < 0){
-                    error("Error occurred with reading the file contents.\n");
-                }
+    while((de = readdir(dr)) != NULL){                                          /* readdir() returns a pointer to a structre representing the directory entry at the current position in the director stream */
+        if(de->d_type == DT_REG || de->d_type == DT_UNKNOWN){                   /* Some file systems do not report the type, so updateIndex() checks it */
+            updateIndex(de->d_name);
+        }
+    }
+    closedir(dr);                                                               /* Close the current directory */
 
-                void *filePtr = buffer;                                         /* filePtr will keep track of where in the buffer we currently are */
+    pthread_rwlock_wrlock(&directoryIndex.lock);
+    for(i = 0; i < directoryIndex.bucketCount; i++){                            /* Remove the files that are gone */
+        struct indexEntry **link = &directoryIndex.buckets[i];
 
-                while(readBytes > 0){                                           /* While loop is used because not all of the data may be sent in a single call */
-                    int writtenBytes = send(newestSocketFD, filePtr, sizeof(buffer), 0);    /* Send the current chunk of data to client and store how many bytes were sent in writtenBytes */
-                    if(writtenBytes < 0){
-                        error("Error occurred with sending the file contents.\n");
-                    }
-                    readBytes -= writtenBytes;                                  /* Decrement the number of readBytes by the number of writtenBytes*/
-                    filePtr += writtenBytes;                                    /* Move filePtr to point to the next chunk of data in the buffer */
-                }
+        while(*link != NULL){
+            if((*link)->seen != directoryIndex.scan){
+                struct indexEntry *removed = *link;
 
-                memset(buffer, 0, sizeof(buffer));                              /* Ensure that buffer is empty */
+                *link = removed->next;
+                free(removed);
+                directoryIndex.entryCount--;
+                directoryIndex.generation++;
+            }
+            else{
+                link = &(*link)->next;
             }
+        }
+    }
+    pthread_rwlock_unlock(&directoryIndex.lock);
+
+    recordHistogram(&scanTimes, (currentTimeNs() - startedNs) / 1000);
+}
 
-            send(newestSocketFD, endOfFile, strlen(endOfFile), 0);              /* Inform client that all the file contents have been sent */
+/****************************************************************
+* Name: watchDirectory()
+* Description: This function is the entry point of the thread that keeps the directory index up to date. It reads inotify events for
+*               the current directory and updates the entry of each file that was created, changed, moved or deleted. If the
+*               kernel's event queue overflowed, the whole directory is scanned again.
+* Resources used: http://man7.org/linux/man-pages/man7/inotify.7.html
+****************************************************************/
+void *watchDirectory(void *arg){
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
 
-            close(newestSocketFD);                                              /* Close the connection on the socket file descriptor. I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+    (void)arg;
 
-            freeaddrinfo(newAddInfo2);                                          /* Free the linked list allocated by getaddrinfo(). I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-        }    
-        else{                                                                   /* Otherwise, there is not a file in the current directory that matches the file name sent by client */
-            printf("File not found. Sending error message to flip2 at %s: %s\n", hostName, portNum);
+    while(1){
+        ssize_t length = read(directoryIndex.inotifyFD, events, sizeof(events));
+        char *position;
 
-            send(new_socketFD, fileError, strlen(fileError), 0);                /* Inform client that the file could not be found */
+        if(length <= 0){
+            if(length == -1 && errno == EINTR){
+                continue;
+            }
+            logMessage("Error watching the current directory: %s\n", strerror(errno));
+            return NULL;
         }
 
-        for(i = 0; i < BUFFER_SIZE; i++){                                       /* Free the memory that was previously allocated to each char array pointed to by the fileArray */
-            free(fileArray[i]);
+        for(position = events; position < events + length; position += sizeof(struct inotify_event) + ((struct inotify_event *)position)->len){
+            struct inotify_event *event = (struct inotify_event *)position;
+
+            if(event->mask & IN_Q_OVERFLOW){                                    /* Events were lost, so the index may be out of date */
+                scanDirectory();
+            }
+            else if(event->len > 0){
+                updateIndex(event->name);
+            }
         }
-        free(fileArray);                                                        /* Free the memory that was previously allocated for the pointer to a pointer to fileArray char */
     }
-    else{
-        printf("Received invalid command.\n");
-        send(new_socketFD, commandError, strlen(commandError), 0);              /* Inform client that an invalid command was sent */
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: startDirectoryIndex()
+* Description: This function builds the directory index and starts the thread that keeps it up to date. The inotify watch is added
+*               before the directory is scanned so that no change made during the scan is missed.
+****************************************************************/
+void startDirectoryIndex(void){
+    pthread_rwlock_init(&directoryIndex.lock, NULL);
+    pthread_mutex_init(&directoryIndex.listingLock, NULL);
+
+    directoryIndex.bucketCount = INDEX_BUCKETS;
+    directoryIndex.buckets = calloc(directoryIndex.bucketCount, sizeof(struct indexEntry *));
+    if(directoryIndex.buckets == NULL){
+        error("Error allocating the directory index.\n");
+    }
+
+    directoryIndex.inotifyFD = inotify_init1(IN_CLOEXEC);
+    if(directoryIndex.inotifyFD == -1 || inotify_add_watch(directoryIndex.inotifyFD, ".", WATCH_EVENTS) == -1){
+        error("Error watching the current directory.\n");
     }
 
-    printf("Connection closed. Wait for new connection.\n");
+    scanDirectory();
+
+    if(pthread_create(&directoryIndex.thread, NULL, watchDirectory, NULL) != 0){
+        error("Error creating directory watcher thread.\n");
+    }
 }
 
-/* Please note, I referenced Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-int main(int argc, char *argv[]){
-    int socketFD, new_socketFD;
-    int status = 0;
-    struct sockaddr_storage their_addr;                                         /* I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-    socklen_t addr_size;
+/****************************************************************
+* Name: lookupFile()
+* Description: This function receives a file name and a fileInfo structure as arguments and looks the file up in the directory index.
+*               This function will return 1 and fill in the structure if the file is a regular file in the current directory, and 0
+*               otherwise.
+****************************************************************/
+int lookupFile(const char *fileName, struct fileInfo *info){
+    size_t length = strlen(fileName);
+    struct indexEntry *entry;
 
-    if (argc != 2){                                                             /* Verify if the correct number of arguments were used. There should be 3 arguments, which are the command, the server address and the port # */
-        error("Incorrect number of arguments.\n");                                                      
+    pthread_rwlock_rdlock(&directoryIndex.lock);
+    entry = *findEntry(fileName, length, hashName(fileName, length));
+    if(entry != NULL){
+        *info = entry->info;
     }
-    else{
-        printf("Server open on %s\n", argv[1]);
+    pthread_rwlock_unlock(&directoryIndex.lock);
+
+    return entry != NULL;
+}
+
+/****************************************************************
+* Name: sameFile()
+* Description: This function receives two fileInfo structures as arguments and returns 1 if they have the same inode, mtime and size,
+*               and 0 otherwise.
+****************************************************************/
+int sameFile(const struct fileInfo *first, const struct fileInfo *second){
+    return first->inode == second->inode && first->size == second->size && first->mtime.tv_sec == second->mtime.tv_sec && first->mtime.tv_nsec == second->mtime.tv_nsec;
+}
+
+/****************************************************************
+* Name: lookupChecksum()
+* Description: This function receives a file name, the inode, mtime and size of the file and a checksum as arguments. If the directory
+*               index holds the CRC32C of that version of the file, it is stored in checksum and this function will return 1;
+*               otherwise, it will return 0.
+****************************************************************/
+int lookupChecksum(const char *fileName, const struct fileInfo *key, uint32_t *checksum){
+    size_t length = strlen(fileName);
+    struct indexEntry *entry;
+    int found = 0;
+
+    pthread_rwlock_rdlock(&directoryIndex.lock);
+    entry = *findEntry(fileName, length, hashName(fileName, length));
+    if(entry != NULL && entry->hasChecksum && sameFile(&entry->info, key)){
+        *checksum = entry->checksum;
+        found = 1;
     }
+    pthread_rwlock_unlock(&directoryIndex.lock);
 
-    struct addrinfo *addInfo = getAddressInfo(argv[1]);                         /* Call the getAddressInfo() function and return a pointer to addrinfo structure */
+    return found;
+}
 
-    socketFD = createSocket(addInfo);                                           /* Call the createSocket() function to create a socket and return a socket file descriptor */
-  
-    status = bind(socketFD, addInfo->ai_addr, addInfo->ai_addrlen);             /* Call bind() method to bind socket to host the server is running on. I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+/****************************************************************
+* Name: storeChecksum()
+* Description: This function receives a file name, the inode, mtime and size of the file and its CRC32C as arguments and keeps the
+*               checksum in the directory index, so the next download of the same version of the file does not compute it again.
+*               Nothing is stored if the file has changed since.
+****************************************************************/
+void storeChecksum(const char *fileName, const struct fileInfo *key, uint32_t checksum){
+    size_t length = strlen(fileName);
+    struct indexEntry *entry;
 
-    if(status == -1){                                                           /* Close the socket, print out an error message and exit if the call to the bind() function was unsuccessful */
-        close(socketFD);
-        error("Error in binding socket to port.\n");
+    pthread_rwlock_wrlock(&directoryIndex.lock);
+    entry = *findEntry(fileName, length, hashName(fileName, length));
+    if(entry != NULL && sameFile(&entry->info, key)){
+        entry->checksum = checksum;
+        entry->hasChecksum = 1;
     }
+    pthread_rwlock_unlock(&directoryIndex.lock);
+}
 
-    status = 0;
+/****************************************************************
+* Name: compareNames()
+* Description: This function compares two file names for qsort(), which passes pointers to the elements of an array of names.
+****************************************************************/
+int compareNames(const void *first, const void *second){
+    return strcmp(*(char * const *)first, *(char * const *)second);
+}
 
-    status = listen(socketFD, 3);                                               /* Call listen() method to listen to incoming connections on the specified port. I specified 3 connections on the incoming queue */
+/****************************************************************
+* Name: resolveBatch()
+* Description: This function receives a byte buffer and the names and glob patterns of a batch request, each followed by '\0', as
+*               arguments and appends the name of every file the batch sends to the buffer, each followed by '\0'. Plain names are
+*               kept in the order they were given, even if the file does not exist, so that client hears about it. The directory index
+*               is then walked once for all of the patterns, and the files that match any of them follow in name order. This function
+*               will return the number of names, or -1 if the request is invalid or memory ran out.
+* Resources used: http://man7.org/linux/man-pages/man3/fnmatch.3.html
+****************************************************************/
+long resolveBatch(struct byteBuffer *names, const char *list, size_t length){
+    const char **patterns = NULL;
+    size_t patternCount = 0;
+    struct byteBuffer matches = { NULL, 0, 0 };
+    char **sorted = NULL;
+    long count = 0;
+    size_t offset = 0;
+    size_t bucket = 0;
+    size_t i = 0;
 
-    if(status == -1){                                                           /* Close the socket, print out an error message and exit if the call to the listen() function was unsuccessful */
-        close(socketFD);                                                        
-        error("Error in listening on bound socket.\n");
+    if(length == 0 || list[length - 1] != '\0' || (patterns = malloc(length * sizeof(char *))) == NULL){
+        free(patterns);
+        return -1;
     }
 
-    while(1){                                                                   /* Accept the incoming connection. I utilized Beej's Guid for the folloiwng section: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
-        addr_size = sizeof(their_addr);
-        new_socketFD = accept(socketFD, (struct sockaddr *)&their_addr, &addr_size);
+    for(offset = 0; offset < length; offset += strlen(list + offset) + 1){      /* Keep the plain names and set the patterns aside */
+        const char *name = list + offset;
+        size_t nameLength = strlen(name);
 
-        if(new_socketFD == -1){
+        if(nameLength == 0 || nameLength > NAME_MAX || strchr(name, '/') != NULL){
+            free(patterns);
+            return -1;
+        }
+        if(strpbrk(name, "*?[") != NULL){
+            patterns[patternCount++] = name;
             continue;
         }
-        handleRequest(new_socketFD);                                            /* Call the handleRequest() function to handle the incoming request from the client */
-        close(new_socketFD);                                                    /* Close the connection on the socket file descriptor. I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+        if(appendBytes(names, name, nameLength + 1) == -1){
+            free(patterns);
+            return -1;
+        }
+        count++;
     }
 
-    freeaddrinfo(addInfo);                                                      /* Free the linked list allocated by getaddrinfo(). I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+    pthread_rwlock_rdlock(&directoryIndex.lock);
+    for(bucket = 0; patternCount > 0 && bucket < directoryIndex.bucketCount; bucket++){
+        struct indexEntry *entry;
+
+        for(entry = directoryIndex.buckets[bucket]; entry != NULL; entry = entry->next){
+            for(i = 0; i < patternCount; i++){
+                if(fnmatch(patterns[i], entry->name, FNM_PERIOD) == 0){         /* As in the shell, only a pattern that starts with a dot matches hidden files */
+                    if(appendBytes(&matches, entry->name, entry->nameLength + 1) == -1){
+                        count = -1;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    pthread_rwlock_unlock(&directoryIndex.lock);
+    free(patterns);
+
+    if(count != -1 && matches.length > 0){                                      /* Sort the matching files by name */
+        size_t matchCount = 0;
+
+        for(offset = 0; offset < matches.length; offset += strlen(matches.data + offset) + 1){
+            matchCount++;
+        }
+        sorted = malloc(matchCount * sizeof(char *));
+        if(sorted == NULL){
+            count = -1;
+        }
+        for(offset = 0, i = 0; sorted != NULL && offset < matches.length; offset += strlen(matches.data + offset) + 1){
+            sorted[i++] = matches.data + offset;
+        }
+        if(sorted != NULL){
+            qsort(sorted, matchCount, sizeof(char *), compareNames);
+        }
+        for(i = 0; sorted != NULL && i < matchCount; i++){
+            if(appendBytes(names, sorted[i], strlen(sorted[i]) + 1) == -1){
+                count = -1;
+                break;
+            }
+            count++;
+        }
+        free(sorted);
+    }
+    free(matches.data);
+
+    return count;
+}
+
+/****************************************************************
+* Name: releaseListing()
+* Description: This function receives a directory listing as an argument and drops one reference to it. The listing is freed once
+*               the last transfer that sends it has finished and a newer listing has replaced it.
+****************************************************************/
+void releaseListing(struct listing *list){
+    if(list != NULL && __atomic_sub_fetch(&list->references, 1, __ATOMIC_ACQ_REL) == 0){
+        free(list);
+    }
+}
+
+/****************************************************************
+* Name: buildListing()
+* Description: This function receives a protocol version as an argument and serializes the directory index into a new listing:
+*               version 1 clients read each name as a record of BUFFER_SIZE bytes, while version 2 clients receive one entry frame
+*               per file that holds its name and size. The caller must hold the index lock. This function will return the listing, or
+*               NULL if it could not be allocated.
+****************************************************************/
+struct listing *buildListing(int version){
+    struct listing *list;
+    size_t length = 0;
+    size_t i = 0;
+    char *position;
+
+    for(i = 0; i < directoryIndex.bucketCount; i++){                            /* Work out the size first so the listing is allocated once */
+        struct indexEntry *entry;
+
+        for(entry = directoryIndex.buckets[i]; entry != NULL; entry = entry->next){
+            length += version == 1 ? BUFFER_SIZE : FRAME_HEADER_SIZE + entry->nameLength;
+        }
+    }
+
+    list = malloc(sizeof(struct listing) + length);
+    if(list == NULL){
+        return NULL;
+    }
+    list->references = 1;                                                       /* The reference held by the directory index */
+    list->generation = directoryIndex.generation;
+    list->length = length;
+    position = list->data;
+
+    for(i = 0; i < directoryIndex.bucketCount; i++){
+        struct indexEntry *entry;
+
+        for(entry = directoryIndex.buckets[i]; entry != NULL; entry = entry->next){
+            if(version == 1){
+                memset(position, 0, BUFFER_SIZE);                               /* Each file name is padded to BUFFER_SIZE bytes, which is what client reads per name */
+                memcpy(position, entry->name, entry->nameLength < BUFFER_SIZE - 1 ? entry->nameLength : BUFFER_SIZE - 1);
+                position += BUFFER_SIZE;
+            }
+            else{
+                encodeFrameHeader(position, OP_ENTRY, 0, entry->nameLength, entry->info.size);
+                memcpy(position + FRAME_HEADER_SIZE, entry->name, entry->nameLength);
+                position += FRAME_HEADER_SIZE + entry->nameLength;
+            }
+        }
+    }
+
+    return list;
+}
+
+/****************************************************************
+* Name: getListing()
+* Description: This function receives a protocol version as an argument and returns the directory listing for that version with a
+*               reference held for the caller, who must release it with releaseListing(). The listing is only rebuilt when the index
+*               has changed since it was last built, so most requests are served from the same prebuilt buffer. This function will
+*               return NULL if no listing could be built.
+****************************************************************/
+struct listing *getListing(int version){
+    struct listing *list;
+
+    pthread_mutex_lock(&directoryIndex.listingLock);
+    pthread_rwlock_rdlock(&directoryIndex.lock);
+
+    list = directoryIndex.listings[version];
+    if(list == NULL || list->generation != directoryIndex.generation){
+        struct listing *built = buildListing(version);
+
+        if(built != NULL){
+            releaseListing(list);
+            directoryIndex.listings[version] = list = built;
+        }
+    }
+
+    pthread_rwlock_unlock(&directoryIndex.lock);
+    if(list != NULL){
+        __atomic_add_fetch(&list->references, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&directoryIndex.listingLock);
+
+    return list;
+}
+
+/****************************************************************
+* Name: endWalk()
+* Description: This function receives a transfer as an argument and closes the directories of its streaming listing, if it has one.
+****************************************************************/
+void endWalk(struct transfer *xfer){
+    struct listWalk *walk = xfer->walk;
+
+    if(walk == NULL){
+        return;
+    }
+    while(walk->depth > 0){
+        close(walk->levels[--walk->depth].fd);
+    }
+    free(walk);
+    xfer->walk = NULL;
+}
+
+/****************************************************************
+* Name: openLevel()
+* Description: This function receives a streaming listing, the descriptor of the directory being read and the name of a subdirectory in
+*               it as arguments and opens the subdirectory as the next level of the listing. Symbolic links are not followed, so the
+*               listing never leaves the served directory. This function will return 0 if successful and -1 otherwise.
+****************************************************************/
+int openLevel(struct listWalk *walk, int parentFD, const char *name){
+    struct listLevel *parent = &walk->levels[walk->depth - 1];
+    size_t nameLength = strlen(name);
+    int fd;
+
+    if(walk->depth >= LIST_DEPTH || parent->pathLength + nameLength + 1 >= PATH_MAX){
+        return -1;
+    }
+    fd = openat(parentFD, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+
+    memcpy(walk->path + parent->pathLength, name, nameLength);
+    walk->path[parent->pathLength + nameLength] = '/';
+    walk->levels[walk->depth].fd = fd;
+    walk->levels[walk->depth].position = 0;
+    walk->levels[walk->depth].pathLength = parent->pathLength + nameLength + 1;
+    walk->depth++;
+    walk->entriesLength = 0;                                                    /* The entries read so far belong to the parent */
+    walk->entriesNext = 0;
+
+    return 0;
+}
+
+/****************************************************************
+* Name: startWalk()
+* Description: This function receives a connection, the flags and value of its list request and the options that follow the host name
+*               as arguments, and sets up a streaming listing of the served directory for the connection's transfer. The options are
+*               a prefix, then optionally a '\0' and a cursor from the end frame of the previous page. The cursor holds, for each open
+*               directory, its getdents64() offset (8 bytes), then the length of the name of the subdirectory being read (2 bytes)
+*               and the name, which is empty for the last directory. A subdirectory that has disappeared since the previous page is
+*               skipped. This function will return 0 if successful and -1 if the options are invalid or the directory cannot be read.
+* Resources used: http://man7.org/linux/man-pages/man2/getdents.2.html
+*                   http://man7.org/linux/man-pages/man2/lseek.2.html
+****************************************************************/
+int startWalk(struct connection *conn, unsigned int flags, unsigned long long limit, const char *options, size_t length){
+    struct listWalk *walk;
+    size_t prefixLength = strnlen(options, length);
+    const unsigned char *cursor = (const unsigned char *)options + prefixLength + 1;
+    size_t cursorLength = prefixLength < length ? length - prefixLength - 1 : 0;
+
+    if(prefixLength >= PATH_MAX){
+        return -1;
+    }
+    walk = malloc(sizeof(struct listWalk));
+    if(walk == NULL){
+        return -1;
+    }
+    memset(walk, 0, offsetof(struct listWalk, prefix));                         /* The buffers need not be cleared */
+    walk->details = (flags & FLAG_DETAILS) != 0;
+    walk->recursive = (flags & FLAG_RECURSIVE) != 0;
+    walk->limit = limit;
+    walk->prefixLength = prefixLength;
+    memcpy(walk->prefix, options, prefixLength);
+    conn->transfer.walk = walk;
+
+    walk->levels[0].fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(walk->levels[0].fd == -1){
+        endWalk(&conn->transfer);
+        return -1;
+    }
+    walk->depth = 1;
+
+    while(cursorLength > 0){                                                    /* Go back to where the previous page stopped */
+        struct listLevel *level = &walk->levels[walk->depth - 1];
+        char name[NAME_MAX + 1];
+        uint64_t offset;
+        size_t nameLength;
+
+        if(cursorLength < sizeof(offset) + 2){
+            endWalk(&conn->transfer);
+            return -1;
+        }
+        memcpy(&offset, cursor, sizeof(offset));
+        nameLength = (cursor[8] << 8) | cursor[9];
+        cursor += sizeof(offset) + 2;
+        cursorLength -= sizeof(offset) + 2;
+
+        level->position = (off_t)be64toh(offset);
+        if(nameLength > cursorLength || nameLength > NAME_MAX || (nameLength == 0 && cursorLength > 0) || (nameLength != 0 && !walk->recursive) || lseek(level->fd, level->position, SEEK_SET) == -1){
+            endWalk(&conn->transfer);
+            return -1;
+        }
+        memcpy(name, cursor, nameLength);
+        name[nameLength] = '\0';
+        cursor += nameLength;
+        cursorLength -= nameLength;
+
+        if(nameLength == 0){
+            break;
+        }
+        if(strchr(name, '/') != NULL || memchr(name, '\0', nameLength) != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            endWalk(&conn->transfer);
+            return -1;
+        }
+        if(openLevel(walk, level->fd, name) == -1){                             /* The subdirectory is gone, so go on after it */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: appendCursor()
+* Description: This function receives a byte buffer and a streaming listing as arguments and appends the cursor that resumes the
+*               listing where it stopped, in the layout read by startWalk(). This function will return 0 if successful and -1 otherwise.
+****************************************************************/
+int appendCursor(struct byteBuffer *out, struct listWalk *walk){
+    int i = 0;
+
+    for(i = 0; i < walk->depth; i++){
+        uint64_t offset = htobe64((uint64_t)walk->levels[i].position);
+        size_t nameLength = i + 1 < walk->depth ? walk->levels[i + 1].pathLength - walk->levels[i].pathLength - 1 : 0;
+        unsigned char lengthField[2] = { nameLength >> 8, nameLength & 0xFF };
+
+        if(appendBytes(out, &offset, sizeof(offset)) == -1 || appendBytes(out, lengthField, sizeof(lengthField)) == -1 || appendBytes(out, walk->path + walk->levels[i].pathLength, nameLength) == -1){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: nextRecords()
+* Description: This function receives a connection as an argument and reads the next part of its streaming listing into the head of
+*               its transfer as one records frame. Each record holds the length of the path (2 bytes), the type of the entry as a
+*               d_type value (1 byte), with the details flag its size (8 bytes) and mtime in nanoseconds (8 bytes), and then the path,
+*               which is relative to the served directory. Entries are read with getdents64() into a large buffer, and only stat
+*               when details were asked for or the file system does not report the type, so memory use does not grow with the size
+*               of the directory. Once the listing is complete or the page is full, an end frame is added whose value holds the
+*               number of records sent and whose payload holds a cursor for the next page, or nothing if the listing is complete.
+*               This function will return 0 if successful and -1 if the directory could not be read or memory ran out.
+* Resources used: http://man7.org/linux/man-pages/man2/getdents.2.html
+*                   http://man7.org/linux/man-pages/man2/fstatat.2.html
+****************************************************************/
+int nextRecords(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct listWalk *walk = xfer->walk;
+    unsigned long long records = 0;
+
+    xfer->head.length = 0;
+    xfer->headSent = 0;
+    if(reserveBytes(&xfer->head, LIST_FRAME_SIZE + FRAME_HEADER_SIZE) == -1){
+        return -1;
+    }
+    xfer->head.length = FRAME_HEADER_SIZE;                                      /* The frame header is filled in once the records are known */
+
+    while(walk->depth > 0 && xfer->head.length < LIST_FRAME_SIZE && (walk->limit == 0 || walk->sent < walk->limit)){
+        struct listLevel *level = &walk->levels[walk->depth - 1];
+        struct dirent64 *entry;
+        struct stat info;
+        unsigned char fields[19];
+        size_t nameLength, pathLength, fieldsLength = 3;
+        int type, matches;
+
+        if(walk->entriesNext >= walk->entriesLength){                           /* Read the next batch of entries */
+            ssize_t entriesRead = getdents64(level->fd, walk->entries, sizeof(walk->entries));
+
+            if(entriesRead < 0){
+                return -1;
+            }
+            walk->entriesLength = entriesRead;
+            walk->entriesNext = 0;
+            if(entriesRead == 0){                                               /* The directory is done, so go on in its parent after it */
+                close(level->fd);
+                walk->depth--;
+                if(walk->depth > 0 && lseek(walk->levels[walk->depth - 1].fd, walk->levels[walk->depth - 1].position, SEEK_SET) == -1){
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        entry = (struct dirent64 *)(walk->entries + walk->entriesNext);
+        walk->entriesNext += entry->d_reclen;
+        level->position = entry->d_off;
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+            continue;
+        }
+        if(walk->depth == 1 && strncmp(entry->d_name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0){    /* An upload that has not been given its name yet */
+            continue;
+        }
+        nameLength = strlen(entry->d_name);
+        pathLength = level->pathLength + nameLength;
+        if(pathLength >= PATH_MAX){
+            continue;
+        }
+        memcpy(walk->path + level->pathLength, entry->d_name, nameLength);
+
+        matches = pathLength >= walk->prefixLength && memcmp(walk->path, walk->prefix, walk->prefixLength) == 0;
+        type = entry->d_type;
+        if((matches && walk->details) || type == DT_UNKNOWN){
+            if(fstatat(level->fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1){    /* The entry was removed after it was read */
+                continue;
+            }
+            type = IFTODT(info.st_mode);
+        }
+
+        if(matches){
+            fields[0] = pathLength >> 8;
+            fields[1] = pathLength & 0xFF;
+            fields[2] = type;
+            if(walk->details){
+                uint64_t size = htobe64((uint64_t)info.st_size);
+                uint64_t mtime = htobe64((uint64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec);
+
+                memcpy(fields + 3, &size, sizeof(size));
+                memcpy(fields + 11, &mtime, sizeof(mtime));
+                fieldsLength = sizeof(fields);
+            }
+            if(appendBytes(&xfer->head, fields, fieldsLength) == -1 || appendBytes(&xfer->head, walk->path, pathLength) == -1){
+                return -1;
+            }
+            walk->sent++;
+            records++;
+        }
+
+        if(type == DT_DIR && walk->recursive && (matches || (pathLength < walk->prefixLength && walk->prefix[pathLength] == '/' && memcmp(walk->path, walk->prefix, pathLength) == 0))){
+            openLevel(walk, level->fd, entry->d_name);                          /* Too deep or unreadable subdirectories are listed but not descended into */
+        }
+    }
+
+    if(records == 0){
+        xfer->head.length = 0;
+    }
+    else{
+        encodeFrameHeader(xfer->head.data, OP_RECORDS, walk->details ? FLAG_DETAILS : 0, xfer->head.length - FRAME_HEADER_SIZE, records);
+    }
+
+    if(walk->depth == 0 || (walk->limit != 0 && walk->sent >= walk->limit)){    /* Tell client how many records it got and where the next page starts */
+        size_t endStart = xfer->head.length;
+
+        if(appendFrame(&xfer->head, OP_END, 0, walk->sent, NULL, 0) == -1 || appendCursor(&xfer->head, walk) == -1){
+            return -1;
+        }
+        encodeFrameHeader(xfer->head.data + endStart, OP_END, 0, xfer->head.length - endStart - FRAME_HEADER_SIZE, walk->sent);
+        walk->finished = 1;
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: destroyFile()
+* Description: This function receives a cached file as an argument and unmaps and closes it once nothing uses it anymore. The caller
+*               must hold the cache lock.
+****************************************************************/
+void destroyFile(struct cachedFile *file){
+    if(file->map != NULL){
+        munmap(file->map, file->key.size);
+        fileCache.mappedBytes -= file->key.size;
+    }
+    close(file->fd);
+    free(file);
+}
+
+/****************************************************************
+* Name: evictFile()
+* Description: This function receives a slot of the hot-file cache as an argument and removes its file from the cache. The file stays
+*               open until the transfers that are sending it have finished. The caller must hold the cache lock.
+****************************************************************/
+void evictFile(size_t slot){
+    struct cachedFile *file = fileCache.slots[slot];
+    struct cachedFile **link = &fileCache.buckets[file->hash & (fileCache.bucketCount - 1)];
+
+    while(*link != file){
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    fileCache.slots[slot] = NULL;
+    file->cached = 0;
+    if(--file->references == 0){
+        destroyFile(file);
+    }
+}
+
+/****************************************************************
+* Name: findSlot()
+* Description: This function finds a free slot in the hot-file cache with the CLOCK algorithm: the hand sweeps the slots, skipping files
+*               that are being sent and giving files that were used since the last sweep a second chance, and evicts the first file
+*               that was not. This function will return the slot, or -1 if every cached file is being sent. The caller must hold the
+*               cache lock.
+* Resources used: https://en.wikipedia.org/wiki/Page_replacement_algorithm#Clock
+****************************************************************/
+ssize_t findSlot(void){
+    size_t steps = 0;
+
+    for(steps = 0; steps < 2 * fileCache.slotCount; steps++){                   /* Two sweeps clear every CLOCK bit on the way */
+        size_t slot = fileCache.hand;
+        struct cachedFile *file = fileCache.slots[slot];
+
+        fileCache.hand = (fileCache.hand + 1) % fileCache.slotCount;
+        if(file == NULL){
+            return slot;
+        }
+        if(file->references > 1){
+            continue;
+        }
+        if(file->referenced){
+            file->referenced = 0;
+            continue;
+        }
+        evictFile(slot);
+        fileCache.evictions++;
+        return slot;
+    }
+
+    return -1;
+}
+
+/****************************************************************
+* Name: findCached()
+* Description: This function receives a file name and its hashName() value as arguments and returns the cached file with that name, or
+*               NULL if the cache does not hold it. The file is found through the bucket its name hashes to, so the lookup takes the
+*               same short time however many files the cache keeps open. The caller must hold the cache lock.
+****************************************************************/
+struct cachedFile *findCached(const char *fileName, uint64_t hash){
+    struct cachedFile *cached;
+
+    for(cached = fileCache.buckets[hash & (fileCache.bucketCount - 1)]; cached != NULL; cached = cached->next){
+        if(cached->hash == hash && strcmp(cached->name, fileName) == 0){
+            return cached;
+        }
+    }
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: acquireFile()
+* Description: This function receives a file name and what the directory index knows about the file as arguments and returns the open
+*               file with a reference held for the caller, who must release it with releaseFile(). If the cache holds the file with
+*               the same inode, mtime and size, its descriptor is reused without calling open() or fstat(); otherwise, the file is
+*               opened and its fstat() is compared with the cached file again once the lock is retaken. If the cached file turns out
+*               to be the version just opened, because another worker added it meanwhile or the index has not caught up with a
+*               change yet, it is reused and the new descriptor closed. Otherwise, the file is added to the cache, replacing an older
+*               version of it. This function will return NULL if the file could not be opened or is not a regular file.
+****************************************************************/
+struct cachedFile *acquireFile(const char *fileName, const struct fileInfo *info){
+    size_t length = strlen(fileName);
+    uint64_t hash = hashName(fileName, length);
+    struct cachedFile *file = NULL;
+    struct cachedFile *cached;
+    struct stat fileStat;
+    ssize_t slot = 0;
+    int fd;
+
+    pthread_mutex_lock(&fileCache.lock);
+    cached = findCached(fileName, hash);
+    if(cached != NULL && sameFile(&cached->key, info)){
+        cached->referenced = 1;
+        cached->references++;
+        fileCache.hits++;
+        pthread_mutex_unlock(&fileCache.lock);
+        return cached;
+    }
+    fileCache.misses++;
+    pthread_mutex_unlock(&fileCache.lock);
+
+    fd = open(fileName, O_RDONLY | O_CLOEXEC);                                  /* Open the file name held by fileName in the current directory */
+    if(fd == -1){
+        return NULL;
+    }
+    if(fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || (file = calloc(1, sizeof(struct cachedFile))) == NULL){
+        close(fd);
+        return NULL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);                             /* Let the kernel read ahead aggressively */
+
+    file->references = 1;
+    file->fd = fd;
+    file->key.size = fileStat.st_size;
+    file->key.mtime = fileStat.st_mtim;
+    file->key.inode = fileStat.st_ino;
+    file->hash = hash;
+    memcpy(file->name, fileName, length + 1);
+
+    pthread_mutex_lock(&fileCache.lock);
+    cached = findCached(fileName, hash);
+    if(cached != NULL && sameFile(&cached->key, &file->key)){                   /* The cache already holds the version that was opened */
+        cached->referenced = 1;
+        cached->references++;
+        pthread_mutex_unlock(&fileCache.lock);
+        close(fd);
+        free(file);
+        return cached;
+    }
+    if(cached != NULL){
+        evictFile(cached->slot);                                                /* The file has changed since it was opened */
+    }
+    slot = findSlot();
+    if(slot != -1){                                                             /* Otherwise, the file is closed once this transfer is done */
+        fileCache.slots[slot] = file;
+        file->slot = slot;
+        file->next = fileCache.buckets[hash & (fileCache.bucketCount - 1)];
+        fileCache.buckets[hash & (fileCache.bucketCount - 1)] = file;
+        file->cached = 1;
+        file->referenced = 1;
+        file->references++;
+    }
+    pthread_mutex_unlock(&fileCache.lock);
+
+    return file;
+}
+
+/****************************************************************
+* Name: releaseFile()
+* Description: This function receives a cached file as an argument and drops one reference to it. A file that is no longer in the cache
+*               is closed once the last transfer sending it has finished.
+****************************************************************/
+void releaseFile(struct cachedFile *file){
+    if(file == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&fileCache.lock);
+    if(--file->references == 0){
+        destroyFile(file);
+    }
+    pthread_mutex_unlock(&fileCache.lock);
+}
+
+/****************************************************************
+* Name: retainFile()
+* Description: This function receives a cached file as an argument and takes one more reference to it, which is dropped with
+*               releaseFile().
+****************************************************************/
+void retainFile(struct cachedFile *file){
+    pthread_mutex_lock(&fileCache.lock);
+    file->references++;
+    pthread_mutex_unlock(&fileCache.lock);
+}
+
+/****************************************************************
+* Name: mapFile()
+* Description: This function receives a cached file as an argument and returns the file mapped read-only, mapping it the first time it
+*               is asked for if the mapped bytes stay within the memory budget. The copy mode sends straight from the mapping, so
+*               the file is copied once, from the page cache to the socket, instead of being read into a buffer first. The mapping is
+*               only ever handed to send(), never read by the server itself, so a file truncated by another program makes send()
+*               fail instead of raising SIGBUS. This function will return NULL if the file is not mapped.
+* Resources used: http://man7.org/linux/man-pages/man2/mmap.2.html
+****************************************************************/
+void *mapFile(struct cachedFile *file){
+    if(__atomic_load_n(&file->mapTried, __ATOMIC_ACQUIRE)){
+        return file->map;
+    }
+
+    pthread_mutex_lock(&fileCache.lock);
+    if(!file->mapTried && file->key.size > 0 && fileCache.mappedBytes + file->key.size <= fileCache.mapBudget){
+        void *map = mmap(NULL, file->key.size, PROT_READ, MAP_SHARED, file->fd, 0);
+
+        if(map != MAP_FAILED){
+            file->map = map;
+            fileCache.mappedBytes += file->key.size;
+        }
+    }
+    __atomic_store_n(&file->mapTried, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fileCache.lock);
+
+    return file->map;
+}
+
+/****************************************************************
+* Name: reportCache()
+* Description: This function prints the hit, miss and eviction counters of the hot-file cache, together with the number of files it
+*               holds open and the bytes it has mapped. It runs when the server receives SIGUSR1.
+****************************************************************/
+void reportCache(void){
+    size_t openFiles = 0;
+    size_t i = 0;
+
+    pthread_mutex_lock(&fileCache.lock);
+    for(i = 0; i < fileCache.slotCount; i++){
+        openFiles += fileCache.slots[i] != NULL;
+    }
+    logMessage("File cache: %llu hits, %llu misses, %llu evictions, %zu of %zu files open, %zu of %zu bytes mapped.\n", fileCache.hits, fileCache.misses, fileCache.evictions, openFiles, fileCache.slotCount, fileCache.mappedBytes, fileCache.mapBudget);
+    pthread_mutex_unlock(&fileCache.lock);
+}
+
+/****************************************************************
+* Name: addHistogram()
+* Description: This function receives a histogram and the histogram of one worker as arguments and adds the worker's counts to the first.
+****************************************************************/
+void addHistogram(struct histogram *total, struct histogram *histogram){
+    int i = 0;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+        total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+    total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+}
+
+/****************************************************************
+* Name: appendHistogram()
+* Description: This function receives a byte buffer, the name and description of a metric and a histogram as arguments and appends the
+*               histogram in the Prometheus text format, with cumulative buckets. The count is taken from the buckets, which are
+*               read one at a time while the workers keep counting, so that it always matches the last bucket.
+* Resources used: https://prometheus.io/docs/instrumenting/exposition_formats/
+****************************************************************/
+int appendHistogram(struct byteBuffer *out, const char *name, const char *help, struct histogram *histogram){
+    unsigned long long count = 0;
+    int i = 0;
+
+    if(appendText(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name) == -1){
+        return -1;
+    }
+    for(i = 0; i < HISTOGRAM_BUCKETS - 1; i++){                                 /* The last bucket also holds the larger values, so it is only reported as +Inf */
+        count += histogram->buckets[i];
+        if(appendText(out, "%s_bucket{le=\"%llu\"} %llu\n", name, 1ULL << i, count) == -1){
+            return -1;
+        }
+    }
+    count += histogram->buckets[i];
+
+    return appendText(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n", name, count, name, histogram->sum, name, count);
+}
+
+/****************************************************************
+* Name: buildMetrics()
+* Description: This function receives a byte buffer as an argument and appends the server's counters to it in the Prometheus text
+*               format: the counters of every worker added up, the directory scan times, the hot-file cache counters and the number
+*               of log lines dropped. This function will return 0 if successful and -1 if memory ran out.
+* Resources used: https://prometheus.io/docs/instrumenting/exposition_formats/
+****************************************************************/
+int buildMetrics(struct byteBuffer *out){
+    static const char *requestNames[REQUEST_KINDS] = { "list", "get", "stat", "batch", "stats", "put" };
+    static const char *failureNames[FAILURE_KINDS] = { "command", "file", "request", "range", "upload", "connect", "send" };
+    unsigned long long requests[REQUEST_KINDS] = { 0 };
+    unsigned long long failures[FAILURE_KINDS] = { 0 };
+    unsigned long long connections = 0;
+    unsigned long long closed = 0;
+    unsigned long long sentBytes = 0;
+    unsigned long long files = 0;
+    unsigned long long receivedBytes = 0;
+    unsigned long long uploads = 0;
+    unsigned long long cacheHits, cacheMisses, cacheEvictions, dropped;
+    struct histogram firstByte, transferRate, scans;
+    size_t indexedFiles = 0;
+    int failed = 0;
+    int i = 0;
+    int j = 0;
+
+    memset(&firstByte, 0, sizeof(firstByte));
+    memset(&transferRate, 0, sizeof(transferRate));
+    memset(&scans, 0, sizeof(scans));
+
+    for(i = 0; i < workerCount; i++){                                           /* Add up the counters of every worker */
+        struct metrics *metrics = &workerList[i].metrics;
+
+        connections += __atomic_load_n(&metrics->connections, __ATOMIC_RELAXED);
+        closed += __atomic_load_n(&metrics->closed, __ATOMIC_RELAXED);
+        for(j = 0; j < REQUEST_KINDS; j++){
+            requests[j] += __atomic_load_n(&metrics->requests[j], __ATOMIC_RELAXED);
+        }
+        for(j = 0; j < FAILURE_KINDS; j++){
+            failures[j] += __atomic_load_n(&metrics->failures[j], __ATOMIC_RELAXED);
+        }
+        sentBytes += __atomic_load_n(&metrics->sentBytes, __ATOMIC_RELAXED);
+        files += __atomic_load_n(&metrics->files, __ATOMIC_RELAXED);
+        receivedBytes += __atomic_load_n(&metrics->receivedBytes, __ATOMIC_RELAXED);
+        uploads += __atomic_load_n(&metrics->uploads, __ATOMIC_RELAXED);
+        addHistogram(&firstByte, &metrics->firstByte);
+        addHistogram(&transferRate, &metrics->transferRate);
+    }
+    addHistogram(&scans, &scanTimes);
+
+    pthread_mutex_lock(&fileCache.lock);
+    cacheHits = fileCache.hits;
+    cacheMisses = fileCache.misses;
+    cacheEvictions = fileCache.evictions;
+    pthread_mutex_unlock(&fileCache.lock);
+
+    pthread_rwlock_rdlock(&directoryIndex.lock);
+    indexedFiles = directoryIndex.entryCount;
+    pthread_rwlock_unlock(&directoryIndex.lock);
+
+    pthread_mutex_lock(&logger.lock);
+    dropped = logger.dropped;
+    pthread_mutex_unlock(&logger.lock);
+
+    failed |= appendText(out, "# HELP pyfts_connections_total TCP control connections accepted.\n# TYPE pyfts_connections_total counter\npyfts_connections_total %llu\n", connections);
+    failed |= appendText(out, "# HELP pyfts_connections_open TCP control connections open.\n# TYPE pyfts_connections_open gauge\npyfts_connections_open %llu\n", connections - closed);
+    failed |= appendText(out, "# HELP pyfts_requests_total Requests received, by type.\n# TYPE pyfts_requests_total counter\n");
+    for(j = 0; j < REQUEST_KINDS; j++){
+        failed |= appendText(out, "pyfts_requests_total{type=\"%s\"} %llu\n", requestNames[j], requests[j]);
+    }
+    failed |= appendText(out, "# HELP pyfts_errors_total Requests rejected and transfers that failed, by type.\n# TYPE pyfts_errors_total counter\n");
+    for(j = 0; j < FAILURE_KINDS; j++){
+        failed |= appendText(out, "pyfts_errors_total{type=\"%s\"} %llu\n", failureNames[j], failures[j]);
+    }
+    failed |= appendText(out, "# HELP pyfts_sent_bytes_total Bytes of listings, frames and file contents sent.\n# TYPE pyfts_sent_bytes_total counter\npyfts_sent_bytes_total %llu\n", sentBytes);
+    failed |= appendText(out, "# HELP pyfts_files_sent_total Files sent in full.\n# TYPE pyfts_files_sent_total counter\npyfts_files_sent_total %llu\n", files);
+    failed |= appendText(out, "# HELP pyfts_received_bytes_total Bytes of uploaded file contents received.\n# TYPE pyfts_received_bytes_total counter\npyfts_received_bytes_total %llu\n", receivedBytes);
+    failed |= appendText(out, "# HELP pyfts_files_received_total Uploaded files stored.\n# TYPE pyfts_files_received_total counter\npyfts_files_received_total %llu\n", uploads);
+    failed |= appendHistogram(out, "pyfts_first_byte_microseconds", "Time from a request, or from accept() for the first request of a connection, until its first byte was sent.", &firstByte);
+    failed |= appendHistogram(out, "pyfts_transfer_bytes_per_second", "Throughput of each file sent.", &transferRate);
+    failed |= appendHistogram(out, "pyfts_directory_scan_microseconds", "Time taken by each full scan of the directory.", &scans);
+    failed |= appendText(out, "# HELP pyfts_directory_files Files in the directory index.\n# TYPE pyfts_directory_files gauge\npyfts_directory_files %zu\n", indexedFiles);
+    failed |= appendText(out, "# HELP pyfts_file_cache_hits_total Hot-file cache hits.\n# TYPE pyfts_file_cache_hits_total counter\npyfts_file_cache_hits_total %llu\n", cacheHits);
+    failed |= appendText(out, "# HELP pyfts_file_cache_misses_total Hot-file cache misses.\n# TYPE pyfts_file_cache_misses_total counter\npyfts_file_cache_misses_total %llu\n", cacheMisses);
+    failed |= appendText(out, "# HELP pyfts_file_cache_evictions_total Hot-file cache evictions.\n# TYPE pyfts_file_cache_evictions_total counter\npyfts_file_cache_evictions_total %llu\n", cacheEvictions);
+    failed |= appendText(out, "# HELP pyfts_log_dropped_total Log lines dropped by the rate limit or because the log buffer was full.\n# TYPE pyfts_log_dropped_total counter\npyfts_log_dropped_total %llu\n", dropped);
+
+    return failed;
+}
+
+/****************************************************************
+* Name: requestReport()
+* Description: This function is the SIGUSR1 handler. It only sets a flag, and the worker whose epoll_pwait() it interrupted prints the
+*               report.
+****************************************************************/
+void requestReport(int signalNumber){
+    (void)signalNumber;
+    reportRequested = 1;
+}
+
+/****************************************************************
+* Name: discardUpload()
+* Description: This function receives a transfer as an argument and closes and removes the file of its upload, if it has one, so that
+*               an upload that did not complete leaves nothing behind.
+****************************************************************/
+void discardUpload(struct transfer *xfer){
+    if(!xfer->uploading){
+        return;
+    }
+    if(xfer->fileFD != -1){
+        close(xfer->fileFD);
+        xfer->fileFD = -1;
+    }
+    if(xfer->tempNamed && xfer->tempName[0] != '\0'){
+        unlink(xfer->tempName);
+    }
+    xfer->tempName[0] = '\0';
+    xfer->uploading = 0;
+}
+
+/****************************************************************
+* Name: closeConnection()
+* Description: This function receives a connection as an argument. It closes the TCP control and data connections along with any file
+*               that is being sent and moves the connection to the worker's closed list. The memory is freed once the worker has finished
+*               the current batch of events, since other events in the same batch may still refer to the connection, or once the
+*               prefetch the transfer was waiting for has completed.
+****************************************************************/
+void closeConnection(struct connection *conn){
+    struct worker *owner = conn->control.owner;
+    struct connection **link;
+
+    if(conn->closed){
+        return;
+    }
+    conn->closed = 1;
+
+    for(link = &owner->retryList; *link != NULL; link = &(*link)->next){        /* Remove the connection from the retry list if it is waiting there */
+        if(*link == conn){
+            *link = conn->next;
+            break;
+        }
+    }
+
+    if(conn->data.fd != -1){
+        close(conn->data.fd);                                                   /* Closing a socket also removes it from the epoll instance */
+    }
+    close(conn->control.fd);
+
+    releaseFile(conn->transfer.file);
+    discardUpload(&conn->transfer);
+    if(conn->transfer.pipeFDs[0] != -1){
+        close(conn->transfer.pipeFDs[0]);
+        close(conn->transfer.pipeFDs[1]);
+    }
+    free(conn->transfer.head.data);
+    releaseListing(conn->transfer.listing);
+    endWalk(&conn->transfer);
+    free(conn->transfer.buffer);
+    free(conn->transfer.rawBlock);
+    free(conn->transfer.block);
+    free(conn->transfer.checksumBuffer);
+    free(conn->input.data);
+    free(conn->output.data);
+    free(conn->batch.data);
+
+    if(conn->dataAddress != NULL){
+        freeaddrinfo(conn->dataAddress);                                        /* Free the linked list allocated by getaddrinfo(). I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+    }
+
+    if(!conn->prefetching){                                                     /* Otherwise, the connection is freed once its prefetch has completed */
+        conn->next = owner->closedList;
+        owner->closedList = conn;
+    }
+    countMetric(&owner->metrics.closed, 1);
+
+    logMessage("Connection closed. Wait for new connection.\n");
+}
+
+/****************************************************************
+* Name: flushReply()
+* Description: This function receives a connection as an argument and sends as much of the pending control messages as the socket
+*               will accept. Once the messages have been sent and the connection is in the closing state, the connection is closed.
+*               This function will return 0 once the messages have been sent, 1 if some are still pending and -1 if an error occurred.
+****************************************************************/
+int flushReply(struct connection *conn){
+    while(conn->outputSent < conn->output.length){
+        ssize_t charsWritten = send(conn->control.fd, conn->output.data + conn->outputSent, conn->output.length - conn->outputSent, MSG_NOSIGNAL);
+
+        if(charsWritten < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1;                                                       /* The rest is sent once epoll reports that the socket is writable */
+            }
+            closeConnection(conn);
+            return -1;
+        }
+        conn->outputSent += charsWritten;
+    }
+
+    conn->output.length = 0;                                                    /* Everything has been sent, so the buffer can be reused */
+    conn->outputSent = 0;
+
+    if(conn->state == STATE_CLOSING){
+        closeConnection(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: sendReply()
+* Description: This function receives a connection and a version 1 control message as arguments. It queues the message on the TCP
+*               control connection and sends it. This function will return the result of flushReply().
+****************************************************************/
+int sendReply(struct connection *conn, const char *msg){
+    if(appendBytes(&conn->output, msg, strlen(msg)) == -1){
+        closeConnection(conn);
+        return -1;
+    }
+
+    return flushReply(conn);
+}
+
+/****************************************************************
+* Name: sendFrame()
+* Description: This function receives a connection, the fields of a version 2 frame and its payload as arguments. It queues the frame
+*               on the TCP control connection and sends it. This function will return the result of flushReply().
+****************************************************************/
+int sendFrame(struct connection *conn, int opcode, unsigned int flags, unsigned long long value, const void *payload, size_t length){
+    if(appendFrame(&conn->output, opcode, flags, value, payload, length) == -1){
+        closeConnection(conn);
+        return -1;
+    }
+
+    return flushReply(conn);
+}
+
+/****************************************************************
+* Name: acceptRequest()
+* Description: This function receives a connection as an argument and tells client that its request was accepted, with "NCE" for a
+*               version 1 "-l" command, "NFE" for a version 1 "-g" command and an ok frame for version 2. This function will return
+*               the result of flushReply().
+****************************************************************/
+int acceptRequest(struct connection *conn){
+    if(conn->version == 1){
+        return sendReply(conn, strcmp(conn->command, "l") == 0 ? "NCE" : "NFE");
+    }
+
+    return sendFrame(conn, OP_OK, 0, strcmp(conn->command, "b") == 0 ? (unsigned long long)conn->batchCount : 0, NULL, 0);    /* A batch is answered with its number of files */
+}
+
+/****************************************************************
+* Name: rejectRequest()
+* Description: This function receives a connection, an error code and a message as arguments. It tells client that its request was
+*               rejected, with "CE" or "FE" for version 1 and an error frame for version 2. Version 1 connections are closed afterwards,
+*               as are version 2 connections that sent an invalid frame; otherwise, the version 2 connection waits for the next request.
+****************************************************************/
+void rejectRequest(struct connection *conn, int code, const char *message){
+    countMetric(&conn->control.owner->metrics.failures[code - 1], 1);           /* The error codes are numbered from 1 in the order of the failure kinds */
+    conn->state = conn->version == 1 || code == ERROR_REQUEST ? STATE_CLOSING : STATE_REQUEST;
+
+    if(conn->version == 1){
+        sendReply(conn, code == ERROR_FILE ? "FE" : "CE");
+        return;
+    }
+
+    sendFrame(conn, OP_ERROR, code, 0, message, strlen(message));
+}
+
+/****************************************************************
+* Name: setTail()
+* Description: This function receives a connection and a version 1 marker as arguments and sets the marker that ends its transfer.
+*               Version 2 transfers always end with an end frame instead.
+****************************************************************/
+void setTail(struct connection *conn, const char *marker){
+    struct transfer *xfer = &conn->transfer;
+
+    if(conn->version == 1){
+        xfer->tailLength = strlen(marker);
+        memcpy(xfer->tail, marker, xfer->tailLength);
+        return;
+    }
+
+    encodeFrameHeader(xfer->tail, OP_END, 0, 0, 0);
+    xfer->tailLength = FRAME_HEADER_SIZE;
+}
+
+/****************************************************************
+* Name: failDataConnection()
+* Description: This function receives a connection as an argument and is called when the TCP data connection could not be opened.
+*               If attempts remain, the connection is placed on the worker's retry list, since client may not be listening on the
+*               data port yet. Otherwise, the connection is closed.
+****************************************************************/
+void failDataConnection(struct connection *conn){
+    struct worker *owner = conn->control.owner;
+
+    if(conn->data.fd != -1){
+        close(conn->data.fd);
+        conn->data.fd = -1;
+    }
+
+    conn->connectAttempts++;
+    if(conn->connectAttempts >= CONNECT_ATTEMPTS){
+        logMessage("Unable to connect to %s: %s\n", conn->hostName, conn->portNum);
+        countMetric(&owner->metrics.failures[FAILURE_CONNECT], 1);
+        closeConnection(conn);
+        return;
+    }
+
+    conn->retryAt = currentTimeMs() + CONNECT_RETRY_MS;
+    conn->next = owner->retryList;
+    owner->retryList = conn;
+}
+
+/****************************************************************
+* Name: checksumFile()
+* Description: This function receives a transfer, an offset and a length as arguments and adds that part of its file to the checksum.
+*               sendfile() and splice() never copy the file into the server, so this is a second pass that reads the part they just
+*               sent back from the page cache, where it still is. The bytes read back are only the bytes sent if the file was not
+*               written in between, which checksumCurrent() checks once the whole file has been sent. This function will return 0,
+*               or -1 if the file could not be read.
+****************************************************************/
+int checksumFile(struct transfer *xfer, off_t offset, size_t length){
+    if(xfer->checksumBuffer == NULL){
+        xfer->checksumBuffer = malloc(CHECKSUM_CHUNK_SIZE);
+        if(xfer->checksumBuffer == NULL){
+            return -1;
+        }
+    }
+
+    while(length > 0){
+        ssize_t readBytes = pread(xfer->fileFD, xfer->checksumBuffer, length < CHECKSUM_CHUNK_SIZE ? length : CHECKSUM_CHUNK_SIZE, offset);
+
+        if(readBytes <= 0){
+            return -1;
+        }
+        xfer->checksum = updateChecksum(xfer->checksum, (const unsigned char *)xfer->checksumBuffer, readBytes);
+        offset += readBytes;
+        length -= readBytes;
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: checksumCurrent()
+* Description: This function receives a transfer as an argument once its whole file has been sent and checks that the file still has the
+*               inode, mtime and size it had when the transfer started. Otherwise, the checksum read back by checksumFile() may describe
+*               bytes that client never received. This function will return 1 if the checksum can be sent, or 0 if it cannot.
+****************************************************************/
+int checksumCurrent(struct transfer *xfer){
+    struct stat fileStat;
+    struct fileInfo info;
+
+    if(fstat(xfer->fileFD, &fileStat) == -1){
+        return 0;
+    }
+    info.size = fileStat.st_size;
+    info.mtime = fileStat.st_mtim;
+    info.inode = fileStat.st_ino;
+    return sameFile(&info, &xfer->checksumKey);
+}
+
+/****************************************************************
+* Name: sendFileChunk()
+* Description: This function receives a connection as an argument and moves the next chunk of its file to the socket of the transfer.
+*               By default, sendfile() sends the file straight from the page cache without copying it through user space. If the
+*               file cannot be used with sendfile(), the pages are moved through a pipe with splice() instead, and if that is not
+*               possible either the chunk is copied with read() and send(). This function will return the number of bytes sent, 0 once
+*               the file has been sent up to fileEnd and -1 if an error occurred (including EAGAIN when the socket is full).
+* Resources used: http://man7.org/linux/man-pages/man2/sendfile.2.html
+*                   http://man7.org/linux/man-pages/man2/splice.2.html
+*                   https://stackoverflow.com/questions/2014033/send-and-receive-a-file-in-socket-programming-in-linux-with-c-c-gcc-g
+****************************************************************/
+ssize_t sendFileChunk(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    size_t chunk = SEND_CHUNK_SIZE;
+    ssize_t moved;
+
+    if(xfer->fileEnd >= 0 && xfer->fileEnd - xfer->fileOffset < (off_t)chunk){  /* Never send past the size announced to client */
+        chunk = (size_t)(xfer->fileEnd - xfer->fileOffset);
+    }
+
+    if(xfer->mode == MODE_SENDFILE){
+        if(chunk == 0){
+            return 0;
+        }
+        moved = sendfile(xfer->socketFD, xfer->fileFD, &xfer->fileOffset, chunk);
+        if(moved == -1 && (errno == EINVAL || errno == ENOSYS)){                /* The file does not support sendfile(), so fall back to splice() */
+            xfer->mode = MODE_SPLICE;
+            return sendFileChunk(conn);
+        }
+        if(moved > 0 && xfer->checksumming && checksumFile(xfer, xfer->fileOffset - moved, moved) == -1){
+            return -1;
+        }
+        return moved;
+    }
+
+    if(xfer->mode == MODE_SPLICE){
+        if(xfer->pipeFDs[0] == -1){
+            if(pipe2(xfer->pipeFDs, O_NONBLOCK | O_CLOEXEC) == -1){
+                xfer->pipeFDs[0] = xfer->pipeFDs[1] = -1;
+                xfer->mode = MODE_COPY;
+                return sendFileChunk(conn);
+            }
+            fcntl(xfer->pipeFDs[1], F_SETPIPE_SZ, SEND_CHUNK_SIZE);             /* A larger pipe lets each splice() move more pages */
+        }
+
+        if(xfer->piped == 0){                                                   /* Fill the pipe with the next pages of the file */
+            if(chunk == 0){
+                return 0;
+            }
+            moved = splice(xfer->fileFD, xfer->seekable ? (loff_t *)&xfer->fileOffset : NULL, xfer->pipeFDs[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(moved == -1 && errno == EINVAL){                                 /* The file cannot be spliced and nothing is left in the pipe, so fall back to copying */
+                xfer->mode = MODE_COPY;
+                return sendFileChunk(conn);
+            }
+            if(moved <= 0){
+                return moved;
+            }
+            if(xfer->checksumming && checksumFile(xfer, xfer->fileOffset - moved, moved) == -1){
+                return -1;
+            }
+            xfer->piped = moved;
+        }
+
+        moved = splice(xfer->pipeFDs[0], NULL, xfer->socketFD, NULL, xfer->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if(moved > 0){
+            xfer->piped -= moved;
+        }
+        return moved;
+    }
+
+    if(xfer->file != NULL && mapFile(xfer->file) != NULL){                      /* Send straight from the mapping, without copying the file into the buffer first */
+        chunk = chunk < copyBufferSize ? chunk : copyBufferSize;
+        if(chunk == 0){
+            return 0;
+        }
+        moved = send(xfer->socketFD, (char *)xfer->file->map + xfer->fileOffset, chunk, MSG_NOSIGNAL | MSG_MORE);
+        if(moved > 0 && xfer->checksumming && checksumFile(xfer, xfer->fileOffset, moved) == -1){
+            return -1;
+        }
+        if(moved > 0){
+            xfer->fileOffset += moved;
+        }
+        return moved;
+    }
+
+    if(xfer->buffer == NULL){
+        xfer->buffer = malloc(copyBufferSize);
+        if(xfer->buffer == NULL){
+            return -1;
+        }
+    }
+
+    if(xfer->bufferSent == xfer->bufferLength){                                 /* Read the next chunk once the previous one has been sent */
+        ssize_t readBytes;
+
+        chunk = chunk < copyBufferSize ? chunk : copyBufferSize;
+        if(chunk == 0){
+            return 0;
+        }
+        readBytes = xfer->seekable ? pread(xfer->fileFD, xfer->buffer, chunk, xfer->fileOffset) : read(xfer->fileFD, xfer->buffer, chunk);
+
+        if(readBytes <= 0){                                                     /* if readBytes == 0, we are done reading from the file */
+            return readBytes;
+        }
+        if(xfer->checksumming){
+            xfer->checksum = updateChecksum(xfer->checksum, (const unsigned char *)xfer->buffer, readBytes);
+        }
+        xfer->fileOffset += readBytes;
+        xfer->bufferLength = readBytes;
+        xfer->bufferSent = 0;
+    }
+
+    moved = send(xfer->socketFD, xfer->buffer + xfer->bufferSent, xfer->bufferLength - xfer->bufferSent, MSG_NOSIGNAL | MSG_MORE);
+    if(moved > 0){
+        xfer->bufferSent += moved;                                              /* Not all of the chunk may be sent in a single call */
+    }
+    return moved;
+}
+
+/****************************************************************
+* Name: compressBlock()
+* Description: This function receives a connection as an argument and compresses length bytes of its raw block into its block frame,
+*               after the frame header, with the compressor the server was built with. The CPU time it takes is added to the
+*               transfer. This function will return the size of the compressed data, or -1 if it could not be compressed into less
+*               space than the raw data.
+* Resources used: https://facebook.github.io/zstd/zstd_manual.html
+*                   https://github.com/lz4/lz4/blob/dev/lib/lz4.h
+*                   https://www.zlib.net/manual.html
+****************************************************************/
+ssize_t compressBlock(struct transfer *xfer, size_t length){
+    char *destination = xfer->block + FRAME_HEADER_SIZE;
+    struct timespec start;
+    struct timespec end;
+    ssize_t compressed = -1;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+#if defined(USE_ZSTD)
+    {
+        size_t result = ZSTD_compress(destination, length, xfer->rawBlock, length, 1);
+
+        compressed = ZSTD_isError(result) ? -1 : (ssize_t)result;
+    }
+#elif defined(USE_LZ4)
+    compressed = LZ4_compress_default(xfer->rawBlock, destination, length, length);
+    compressed = compressed > 0 ? compressed : -1;
+#elif defined(USE_ZLIB)
+    {
+        uLongf result = length;
+
+        compressed = compress2((Bytef *)destination, &result, (const Bytef *)xfer->rawBlock, length, Z_BEST_SPEED) == Z_OK ? (ssize_t)result : -1;
+    }
+#else
+    (void)destination;
+#endif
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    xfer->compressNs += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+    return compressed < (ssize_t)length ? compressed : -1;
+}
+
+/****************************************************************
+* Name: readBlock()
+* Description: This function receives a transfer as an argument and reads the next chunk of its file, up to COMPRESS_BLOCK_SIZE bytes,
+*               into its raw block. This function will return the number of bytes read, 0 once the file has been read up to fileEnd
+*               and -1 if an error occurred.
+****************************************************************/
+ssize_t readBlock(struct transfer *xfer){
+    size_t chunk = COMPRESS_BLOCK_SIZE;
+
+    if(xfer->rawBlock == NULL){
+        xfer->rawBlock = malloc(COMPRESS_BLOCK_SIZE);
+        xfer->block = malloc(FRAME_HEADER_SIZE + COMPRESS_BLOCK_SIZE);          /* A block that does not shrink is sent as it is, so it never needs more space */
+        if(xfer->rawBlock == NULL || xfer->block == NULL){
+            return -1;
+        }
+    }
+
+    if(xfer->fileEnd - xfer->fileOffset < (off_t)chunk){
+        chunk = (size_t)(xfer->fileEnd - xfer->fileOffset);
+    }
+    if(chunk == 0){
+        return 0;
+    }
+
+    return pread(xfer->fileFD, xfer->rawBlock, chunk, xfer->fileOffset);
+}
+
+/****************************************************************
+* Name: setBlock()
+* Description: This function receives a transfer, the length of its raw block and the result of compressBlock() as arguments and builds
+*               the block frame that is sent next. A block that could not be compressed is sent as it is.
+****************************************************************/
+void setBlock(struct transfer *xfer, size_t rawLength, ssize_t compressed){
+    if(xfer->checksumming){
+        xfer->checksum = updateChecksum(xfer->checksum, (const unsigned char *)xfer->rawBlock, rawLength);
+    }
+    if(compressed < 0){
+        memcpy(xfer->block + FRAME_HEADER_SIZE, xfer->rawBlock, rawLength);
+    }
+    encodeFrameHeader(xfer->block, OP_BLOCK, compressed < 0 ? 0 : xfer->compression, compressed < 0 ? rawLength : (size_t)compressed, rawLength);
+
+    xfer->blockLength = FRAME_HEADER_SIZE + (compressed < 0 ? rawLength : (size_t)compressed);
+    xfer->blockSent = 0;
+    xfer->fileOffset += rawLength;
+    xfer->rawBytes += rawLength;
+    xfer->wireBytes += xfer->blockLength;
+}
+
+/****************************************************************
+* Name: startCompression()
+* Description: This function receives a connection as an argument and decides whether its file is sent compressed. Compression is only
+*               used if client can decompress the server's compressor and the first block of the file shrinks enough, so files that are
+*               already compressed are sent as they are with sendfile(). The compressed first block is kept as the first block frame.
+****************************************************************/
+void startCompression(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    ssize_t readBytes;
+    ssize_t compressed;
+
+    if(COMPRESSION_FLAG == 0 || !(conn->compressions & COMPRESSION_FLAG) || !xfer->seekable){
+        return;
+    }
+
+    readBytes = readBlock(xfer);
+    if(readBytes <= 0){
+        return;
+    }
+
+    xfer->compression = COMPRESSION_FLAG;
+    compressed = compressBlock(xfer, readBytes);
+    if(compressed < 0 || compressed > readBytes * COMPRESSION_MAX_RATIO / 100){ /* The sample did not shrink enough to be worth the CPU time */
+        logMessage("Sending %s without compression, since it does not compress well.\n", conn->fileName);
+        xfer->compression = 0;
+        xfer->compressNs = 0;
+        return;
+    }
+
+    setBlock(xfer, readBytes, compressed);
+}
+
+/****************************************************************
+* Name: sendCompressedChunk()
+* Description: This function receives a connection as an argument and sends the next part of its file as block frames, compressing
+*               the next chunk of the file once the previous block has been sent. This function will return the number of bytes sent,
+*               0 once the file has been sent up to fileEnd and -1 if an error occurred (including EAGAIN when the socket is full).
+****************************************************************/
+ssize_t sendCompressedChunk(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    ssize_t moved;
+
+    if(xfer->blockSent == xfer->blockLength){
+        moved = readBlock(xfer);
+        if(moved <= 0){
+            return moved;
+        }
+        setBlock(xfer, moved, compressBlock(xfer, moved));
+    }
+
+    moved = send(xfer->socketFD, xfer->block + xfer->blockSent, xfer->blockLength - xfer->blockSent, MSG_NOSIGNAL | MSG_MORE);
+    if(moved > 0){
+        xfer->blockSent += moved;
+    }
+    return moved;
+}
+
+/****************************************************************
+* Name: markReady()
+* Description: This function receives a connection as an argument and adds it to its worker's ready list. A connection is marked as
+*               ready when it has used up its budget for this turn while the socket could still accept data, or when it finished a
+*               transfer while client may have already sent its next request; since epoll is edge-triggered, no new event would be
+*               reported for it, so the worker resumes it after handling its other events.
+****************************************************************/
+void markReady(struct connection *conn){
+    struct worker *owner = conn->control.owner;
+
+    if(!conn->ready){
+        conn->ready = 1;
+        conn->readyNext = owner->readyList;
+        owner->readyList = conn;
+    }
+}
+
+/****************************************************************
+* Name: windowCached()
+* Description: This function receives a file descriptor, an offset and a length as arguments and asks the kernel with cachestat() how
+*               many pages of that window of the file are in the page cache, which costs one system call and no copy. This function
+*               will return 1 if every page is cached, 0 if one is not and -1 if the kernel does not have cachestat().
+* Resources used: https://man7.org/linux/man-pages/man2/cachestat.2.html
+****************************************************************/
+int windowCached(int fd, off_t offset, size_t length){
+    struct { uint64_t offset; uint64_t length; } range = { (uint64_t)offset, length };
+    struct { uint64_t cache; uint64_t dirty; uint64_t writeback; uint64_t evicted; uint64_t recentlyEvicted; } counts;
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    if(!__atomic_load_n(&cachestatProbes, __ATOMIC_RELAXED)){
+        return -1;
+    }
+    if(syscall(__NR_cachestat, fd, &range, &counts, 0) == -1){
+        if(errno == ENOSYS || errno == EPERM){                                  /* Older kernel, or a seccomp filter that does not know the call */
+            __atomic_store_n(&cachestatProbes, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+        return 1;                                                               /* Any other error is reported when the window is sent */
+    }
+
+    return counts.cache >= (range.offset + length - 1) / pageSize - range.offset / pageSize + 1;
+}
+
+/****************************************************************
+* Name: windowResident()
+* Description: This function receives a file descriptor, an offset and a length as arguments and checks whether that window of the file
+*               is in the page cache. windowCached() answers without reading the window; on kernels without cachestat(), all of the
+*               window is read with RWF_NOWAIT, which fails with EAGAIN instead of waiting for the disk and stops short at the first
+*               page that is not cached. Every page is then read into the same small buffer, so the probe costs a copy through the CPU
+*               cache but no memory. If the file system cannot tell, prefetching is turned off and the window is assumed to be in the
+*               page cache. This function will return 1 if the window can be sent without waiting for the disk and 0 otherwise.
+* Resources used: http://man7.org/linux/man-pages/man2/preadv2.2.html
+****************************************************************/
+int windowResident(int fd, off_t offset, size_t length){
+    int cached = windowCached(fd, offset, length);
+    char page[PROBE_SIZE];
+    struct iovec vectors[PREFETCH_WINDOW / PROBE_SIZE];
+    int count = (length + PROBE_SIZE - 1) / PROBE_SIZE;
+    ssize_t readBytes;
+    int i = 0;
+
+    if(cached != -1){
+        return cached;
+    }
+
+    for(i = 0; i < count; i++){
+        vectors[i].iov_base = page;
+        vectors[i].iov_len = PROBE_SIZE;
+    }
+    vectors[count - 1].iov_len = length - (size_t)(count - 1) * PROBE_SIZE;
+
+    readBytes = preadv2(fd, vectors, count, offset, RWF_NOWAIT);
+    if(readBytes == -1){
+        if(errno == EAGAIN){
+            return 0;
+        }
+        if(errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS){          /* RWF_NOWAIT is not supported */
+            __atomic_store_n(&prefetchProbes, 0, __ATOMIC_RELAXED);
+        }
+        return 1;                                                               /* Any other error is reported when the window is sent */
+    }
+
+    return (size_t)readBytes == length;                                         /* A short read stopped at a page that is not cached, or at a file that shrank */
+}
+
+#ifdef USE_IO_URING
+/****************************************************************
+* Name: queueRead()
+* Description: This function receives a worker and a prefetch as arguments and queues an IORING_OP_READ_FIXED of the next chunk of the
+*               prefetch's window into its registered buffer. The queued reads are submitted together by submitRing().
+* Resources used: https://kernel.dk/io_uring.pdf
+****************************************************************/
+void queueRead(struct worker *owner, struct prefetch *job){
+    struct ring *ring = &owner->ring;
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    size_t length = job->length - job->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = job->file->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(ring->buffers + (size_t)job->slot * PREFETCH_CHUNK);
+    sqe->len = length < PREFETCH_CHUNK ? length : PREFETCH_CHUNK;
+    sqe->off = job->offset + job->done;
+    sqe->buf_index = job->slot;
+    sqe->user_data = (unsigned long long)(uintptr_t)job;
+
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);                 /* The kernel must see the entry before the new tail */
+    ring->queued++;
+}
+
+/****************************************************************
+* Name: startRingRead()
+* Description: This function receives a worker and a prefetch as arguments and starts reading the prefetch's window with the worker's
+*               io_uring instance, or queues the prefetch until one of the registered buffers is free.
+****************************************************************/
+void startRingRead(struct worker *owner, struct prefetch *job){
+    struct ring *ring = &owner->ring;
+    int slot = 0;
+
+    for(slot = 0; slot < RING_BUFFERS; slot++){
+        if(ring->slots[slot] == NULL){
+            ring->slots[slot] = job;
+            job->slot = slot;
+            queueRead(owner, job);
+            return;
+        }
+    }
+
+    job->next = NULL;
+    if(ring->waitingTail != NULL){
+        ring->waitingTail->next = job;
+    }
+    else{
+        ring->waiting = job;
+    }
+    ring->waitingTail = job;
+}
+
+/****************************************************************
+* Name: submitRing()
+* Description: This function receives a worker as an argument and submits every read queued while the worker handled its last batch of
+*               events with a single io_uring_enter() call.
+****************************************************************/
+void submitRing(struct worker *owner){
+    struct ring *ring = &owner->ring;
+
+    if(ring->fd == -1 || ring->queued == 0){
+        return;
+    }
+    while(syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0) == -1 && errno == EINTR){
+    }
+    ring->queued = 0;
+}
+
+/****************************************************************
+* Name: reapRing()
+* Description: This function receives a worker as an argument and handles the completed reads of its io_uring instance. A window that
+*               has not been read in full has its next chunk queued; a window that has is moved to the worker's completed prefetches,
+*               and its buffer is handed to the next prefetch waiting for one.
+****************************************************************/
+void reapRing(struct worker *owner){
+    struct ring *ring = &owner->ring;
+    unsigned head = *ring->cqHead;
+
+    while(head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        struct prefetch *job = (struct prefetch *)(uintptr_t)cqe->user_data;
+        int slot = job->slot;
+
+        head++;
+        if(cqe->res > 0 && (job->done += cqe->res) < job->length){
+            queueRead(owner, job);
+            continue;
+        }
+
+        job->next = owner->doneList;                                            /* An error is reported when the window is sent */
+        owner->doneList = job;
+        ring->slots[slot] = NULL;
+        if(ring->waiting != NULL){
+            struct prefetch *next = ring->waiting;
+
+            ring->waiting = next->next;
+            if(ring->waiting == NULL){
+                ring->waitingTail = NULL;
+            }
+            ring->slots[slot] = next;
+            next->slot = slot;
+            queueRead(owner, next);
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/****************************************************************
+* Name: startRing()
+* Description: This function receives a worker as an argument and sets up its io_uring instance with the raw system calls: the rings
+*               are mapped, RING_BUFFERS buffers are registered so that the kernel does not map them on every read, and the worker's
+*               eventfd is registered so that completions wake up its epoll loop. This function will return 0, or -1 if io_uring is not
+*               available, in which case the worker uses the prefetch threads.
+* Resources used: https://kernel.dk/io_uring.pdf
+*                   http://man7.org/linux/man-pages/man2/io_uring_setup.2.html
+*                   http://man7.org/linux/man-pages/man2/io_uring_register.2.html
+****************************************************************/
+int startRing(struct worker *owner){
+    struct ring *ring = &owner->ring;
+    struct io_uring_params params;
+    struct iovec vectors[RING_BUFFERS];
+    size_t ringSize = 0;
+    size_t sqeSize = 0;
+    char *rings = MAP_FAILED;
+    int i = 0;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->sqes = MAP_FAILED;
+    ring->buffers = MAP_FAILED;
+    ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(ring->fd == -1){
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)){                           /* Kernels before 5.4 map the two rings separately, which is not supported */
+        goto failed;
+    }
+
+    ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if(params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ringSize){
+        ringSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    sqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, (size_t)RING_BUFFERS * PREFETCH_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(rings == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED){
+        goto failed;
+    }
+
+    ring->sqHead = (unsigned *)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(rings + params.sq_off.array);
+    ring->cqHead = (unsigned *)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    for(i = 0; i < RING_BUFFERS; i++){
+        vectors[i].iov_base = ring->buffers + (size_t)i * PREFETCH_CHUNK;
+        vectors[i].iov_len = PREFETCH_CHUNK;
+    }
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, vectors, RING_BUFFERS) == -1 ||
+       syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &owner->wake.fd, 1) == -1){
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+    if(rings != MAP_FAILED){
+        munmap(rings, ringSize);
+    }
+    if(ring->sqes != MAP_FAILED){
+        munmap(ring->sqes, sqeSize);
+    }
+    if(ring->buffers != MAP_FAILED){
+        munmap(ring->buffers, (size_t)RING_BUFFERS * PREFETCH_CHUNK);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+#endif
+
+/****************************************************************
+* Name: runPrefetcher()
+* Description: This function is the entry point of each prefetch thread. It takes the next prefetch from the pool, reads its window so
+*               that the pages are in the page cache by the time the worker sends them, then hands the prefetch back to its worker and
+*               wakes the worker up through its eventfd.
+****************************************************************/
+void *runPrefetcher(void *arg){
+    char *buffer = malloc(PREFETCH_CHUNK);
+    uint64_t one = 1;
+
+    (void)arg;
+    if(buffer == NULL){
+        error("Error allocating a prefetch buffer.\n");
+    }
+
+    while(1){
+        struct prefetch *job;
+        struct worker *owner;
+
+        pthread_mutex_lock(&prefetchPool.lock);
+        while(prefetchPool.head == NULL){
+            pthread_cond_wait(&prefetchPool.wake, &prefetchPool.lock);
+        }
+        job = prefetchPool.head;
+        prefetchPool.head = job->next;
+        if(prefetchPool.head == NULL){
+            prefetchPool.tail = NULL;
+        }
+        pthread_mutex_unlock(&prefetchPool.lock);
+
+        while(job->done < job->length){
+            size_t length = job->length - job->done;
+            ssize_t readBytes = pread(job->file->fd, buffer, length < PREFETCH_CHUNK ? length : PREFETCH_CHUNK, job->offset + job->done);
+
+            if(readBytes <= 0){                                                 /* An error or a file that shrank is reported when the window is sent */
+                break;
+            }
+            job->done += readBytes;
+        }
+
+        owner = job->conn->control.owner;                                       /* The connection is not freed while the prefetch refers to it */
+        pthread_mutex_lock(&owner->doneLock);
+        job->next = owner->doneList;
+        owner->doneList = job;
+        pthread_mutex_unlock(&owner->doneLock);
+        write(owner->wake.fd, &one, sizeof(one));
+    }
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: prefetchWindow()
+* Description: This function receives a connection as an argument and is called before its transfer sends past the part of the file
+*               known to be in the page cache. If the next window of the file is in the page cache, it can be sent straight away.
+*               Otherwise, the window is read into the page cache by the worker's io_uring instance or by a prefetch thread, so that
+*               sendfile(), splice() or read() never hold up the worker's other clients while the disk is read, and the transfer
+*               resumes once the prefetch has completed. This function will return 1 if the transfer has to wait for a prefetch, and
+*               0 if it can go on.
+****************************************************************/
+int prefetchWindow(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct prefetch *job;
+    off_t end;
+    size_t length;
+
+    if(prefetchThreads == 0 || !__atomic_load_n(&prefetchProbes, __ATOMIC_RELAXED) || xfer->file == NULL || !xfer->seekable){
+        return 0;
+    }
+    end = xfer->fileEnd >= 0 ? xfer->fileEnd : xfer->file->key.size;
+    if(xfer->fileOffset >= end){
+        return 0;
+    }
+
+    length = end - xfer->fileOffset < PREFETCH_WINDOW ? (size_t)(end - xfer->fileOffset) : PREFETCH_WINDOW;
+    if(windowResident(xfer->fileFD, xfer->fileOffset, length)){
+        xfer->residentEnd = xfer->fileOffset + length;
+        return 0;
+    }
+
+    job = calloc(1, sizeof(struct prefetch));
+    if(job == NULL){
+        return 0;                                                               /* Read the window in the worker instead */
+    }
+    retainFile(xfer->file);
+    job->conn = conn;
+    job->file = xfer->file;
+    job->offset = xfer->fileOffset;
+    job->length = length;
+    job->slot = -1;
+    conn->prefetching = 1;
+
+#ifdef USE_IO_URING
+    if(conn->control.owner->ring.fd != -1){
+        startRingRead(conn->control.owner, job);
+        return 1;
+    }
+#endif
+
+    pthread_mutex_lock(&prefetchPool.lock);
+    if(prefetchPool.tail != NULL){
+        prefetchPool.tail->next = job;
+    }
+    else{
+        prefetchPool.head = job;
+    }
+    prefetchPool.tail = job;
+    pthread_cond_signal(&prefetchPool.wake);
+    pthread_mutex_unlock(&prefetchPool.lock);
+
+    return 1;
+}
+
+/****************************************************************
+* Name: finishPrefetches()
+* Description: This function receives a worker as an argument and is called when its eventfd reports completed prefetches. Each
+*               transfer that was waiting is marked as ready, so the worker resumes it after handling its other events, and each
+*               connection that was closed while its prefetch ran is freed.
+****************************************************************/
+void finishPrefetches(struct worker *owner){
+    struct prefetch *job;
+    uint64_t count;
+
+    read(owner->wake.fd, &count, sizeof(count));                                /* Reset the eventfd */
+#ifdef USE_IO_URING
+    if(owner->ring.fd != -1){
+        reapRing(owner);
+    }
+#endif
+
+    pthread_mutex_lock(&owner->doneLock);
+    job = owner->doneList;
+    owner->doneList = NULL;
+    pthread_mutex_unlock(&owner->doneLock);
+
+    while(job != NULL){
+        struct prefetch *next = job->next;
+        struct connection *conn = job->conn;
+
+        conn->prefetching = 0;
+        if(conn->closed){
+            conn->next = owner->closedList;
+            owner->closedList = conn;
+        }
+        else{
+            conn->transfer.residentEnd = job->offset + job->length;
+            markReady(conn);
+        }
+        releaseFile(job->file);
+        free(job);
+        job = next;
+    }
+}
+
+/****************************************************************
+* Name: startPrefetching()
+* Description: This function receives a worker as an argument and creates the eventfd that wakes it up when a prefetch has completed.
+*               In builds with io_uring, the worker's io_uring instance is set up as well. This function will return 1 if the worker
+*               needs the prefetch threads, and 0 otherwise.
+* Resources used: http://man7.org/linux/man-pages/man2/eventfd.2.html
+****************************************************************/
+int startPrefetching(struct worker *owner){
+    owner->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    owner->wake.kind = CHANNEL_WAKE;
+    owner->wake.owner = owner;
+    if(owner->wake.fd == -1 || watchChannel(owner, &owner->wake, EPOLLIN) == -1){
+        error("Error in creating the prefetch eventfd.\n");
+    }
+    pthread_mutex_init(&owner->doneLock, NULL);
+
+    if(prefetchThreads == 0){
+        return 0;
+    }
+#ifdef USE_IO_URING
+    if(startRing(owner) == 0){
+        return 0;
+    }
+    logMessage("Worker %d could not set up io_uring, so its files are prefetched by threads.\n", owner->id);
+#endif
+
+    return 1;
+}
+
+/****************************************************************
+* Name: finishFile()
+* Description: This function receives a connection as an argument and is called once the head, file and tail of its transfer have been
+*               sent. It reports what compression saved and resets the transfer for the next file, which is either the next file of a
+*               batch, sent over the same socket, or the file of the next request.
+****************************************************************/
+void finishFile(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct metrics *metrics = &conn->control.owner->metrics;
+
+    if(xfer->startedNs != 0){                                                   /* Record how fast the file went out */
+        long long elapsedNs = currentTimeNs() - xfer->startedNs;
+        off_t sent = xfer->fileOffset - xfer->startOffset;
+
+        if(xfer->wholeFile && xfer->fileOffset == xfer->fileEnd){               /* Ranges, resumed transfers and the streams of a split file are only parts of it */
+            countMetric(&metrics->files, 1);
+        }
+        if(sent > 0){
+            recordHistogram(&metrics->transferRate, (unsigned long long)((double)sent * 1e9 / (elapsedNs > 0 ? elapsedNs : 1)));
+        }
+        xfer->startedNs = 0;
+    }
+
+    if(xfer->compression){                                                      /* Report what compression saved and what it cost */
+        logMessage("Sent %s compressed with %s: %lld bytes instead of %lld, %lld saved, %.3f s of CPU time.\n", conn->fileName, COMPRESSION_NAME, xfer->wireBytes, xfer->rawBytes, xfer->rawBytes - xfer->wireBytes, xfer->compressNs / 1e9);
+    }
+
+    xfer->head.length = 0;
+    xfer->headSent = 0;
+    xfer->fileOffset = 0;
+    xfer->fileEnd = -1;
+    xfer->bufferLength = 0;
+    xfer->bufferSent = 0;
+    xfer->residentEnd = 0;
+    xfer->wholeFile = 0;
+    xfer->announcing = 0;
+    xfer->compression = 0;
+    xfer->blockLength = 0;
+    xfer->blockSent = 0;
+    xfer->rawBytes = 0;
+    xfer->wireBytes = 0;
+    xfer->compressNs = 0;
+    xfer->checksumming = 0;
+    xfer->checksum = 0;
+    xfer->cacheChecksum = 0;
+    xfer->tailLength = 0;
+    xfer->tailSent = 0;
+}
+
+/****************************************************************
+* Name: finishTransfer()
+* Description: This function receives a connection as an argument and is called once its transfer has been sent. Version 1 connections
+*               are closed, as before. Version 2 connections are kept open: the TCP data connection, if there is one, is closed, the
+*               transfer is reset and the connection goes back to waiting for the next request on the TCP control connection. The
+*               connection is marked as ready so that a request that client has already sent is read by the worker.
+****************************************************************/
+void finishTransfer(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    int flag = 0;
+
+    setsockopt(xfer->socketFD, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));     /* Push out the tail together with the last of the file */
+
+    finishFile(conn);
+
+    if(conn->version == 1){
+        closeConnection(conn);                                                  /* Everything has been sent, so close the data and control connections */
+        return;
+    }
+
+    if(conn->data.fd != -1){
+        close(conn->data.fd);
+        conn->data.fd = -1;
+    }
+    if(conn->dataAddress != NULL){
+        freeaddrinfo(conn->dataAddress);
+        conn->dataAddress = NULL;
+    }
+    conn->connectAttempts = 0;
+
+    xfer->overControl = 0;
+    xfer->socketFD = -1;
+    releaseListing(xfer->listing);
+    xfer->listing = NULL;
+    xfer->listingSent = 0;
+    endWalk(xfer);
+    xfer->corked = 0;
+    conn->batch.length = 0;
+    conn->batchNext = 0;
+
+    conn->state = STATE_REQUEST;
+    markReady(conn);
+}
+
+/****************************************************************
+* Name: openFile()
+* Description: This function receives a connection as an argument and opens the file named in the connection for its transfer, through
+*               the directory index and the hot-file cache. This function will return 0, or -1 if there is no such file.
+****************************************************************/
+int openFile(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct fileInfo info;
+
+    if(lookupFile(conn->fileName, &info)){                                      /* If statement to assess whether one of the files in the current directory matches the file named passed to server */
+        xfer->file = acquireFile(conn->fileName, &info);                        /* Reuse the descriptor kept by the hot-file cache, or open the file */
+    }
+    if(xfer->file == NULL){
+        return -1;
+    }
+
+    xfer->fileFD = xfer->file->fd;
+    xfer->seekable = 1;                                                         /* The cache only holds regular files */
+    xfer->mode = transferMode;
+    xfer->fileEnd = xfer->file->key.size;
+    return 0;
+}
+
+/****************************************************************
+* Name: finishAnnouncement()
+* Description: This function receives a connection as an argument and decides whether its file is compressed, adds the file frame that
+*               announces the file contents to the head of a version 2 transfer and sets the tail. This function will return 0, or -1
+*               if memory ran out.
+****************************************************************/
+int finishAnnouncement(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    off_t fileSize = xfer->announcedSize;
+
+    startCompression(conn);
+
+    if(conn->version != 1){                                                     /* Announce the size so client knows where the file ends */
+        char fields[RANGE_SIZE + NAME_MAX];
+        size_t nameLength = strlen(conn->fileName);
+        size_t fieldsLength = 0;
+        uint64_t value = htobe64(xfer->fileOffset - xfer->rawBytes);            /* The first block may already have been compressed */
+
+        if(conn->ranged){                                                       /* Tell client where the range starts and how large the whole file is */
+            memcpy(fields, &value, sizeof(value));
+            value = htobe64(fileSize);
+            memcpy(fields + sizeof(value), &value, sizeof(value));
+            fieldsLength = RANGE_SIZE;
+        }
+        memcpy(fields + fieldsLength, conn->fileName, nameLength);
+
+        if(appendFrame(&xfer->head, OP_FILE, (conn->ranged ? FLAG_RANGE : 0) | xfer->compression, xfer->fileEnd - xfer->fileOffset + xfer->rawBytes, fields, fieldsLength + nameLength) == -1){
+            return -1;
+        }
+    }
+
+    setTail(conn, "EOF");                                                       /* Inform client that all the file contents have been sent */
+    if(conn->verify && !xfer->checksumming){                                    /* The checksum was found in the directory index */
+        encodeFrameHeader(xfer->tail, OP_END, FLAG_CHECKSUM, 0, xfer->checksum);
+    }
+
+    return 0;
+}
+
+/****************************************************************
+* Name: announceFile()
+* Description: This function receives a connection and the size of its file as arguments once the part of the file to send has been
+*               set. It sets up the checksum of the file contents and announces the file with finishAnnouncement(). Deciding whether
+*               to compress the file reads a sample of it, so if client accepts compressed files the announcement is left to
+*               pumpTransfer(), which first has the window being sampled prefetched like any other. This function will return 0, or -1
+*               if memory ran out.
+****************************************************************/
+int announceFile(struct connection *conn, off_t fileSize){
+    struct transfer *xfer = &conn->transfer;
+
+    xfer->startOffset = xfer->fileOffset;
+    xfer->startedNs = currentTimeNs();
+    xfer->announcedSize = fileSize;
+    xfer->wholeFile = xfer->fileOffset == 0 && xfer->fileEnd == xfer->file->key.size;
+
+    if(conn->verify){                                                           /* The checksum of a whole file that was sent before is kept in the directory index */
+        xfer->checksumKey = xfer->file->key;
+        xfer->cacheChecksum = xfer->wholeFile;
+        xfer->checksumming = !(xfer->cacheChecksum && lookupChecksum(conn->fileName, &xfer->checksumKey, &xfer->checksum));
+    }
+
+    if(COMPRESSION_FLAG != 0 && (conn->compressions & COMPRESSION_FLAG) && xfer->seekable){
+        xfer->announcing = 1;
+        return 0;
+    }
+
+    return finishAnnouncement(conn);
+}
+
+/****************************************************************
+* Name: nextBatchFile()
+* Description: This function receives a connection as an argument and sets up its transfer for the next file of its batch request. A
+*               file that has disappeared since the batch was resolved is announced with an error frame in place of its file frame,
+*               and the batch goes on. This function will return 1 if there was a next file, 0 at the end of the batch and -1 if
+*               memory ran out.
+****************************************************************/
+int nextBatchFile(struct connection *conn){
+    const char *name;
+
+    if(conn->batchNext >= conn->batch.length){
+        return 0;
+    }
+    name = conn->batch.data + conn->batchNext;
+    conn->batchNext += strlen(name) + 1;
+    strcpy(conn->fileName, name);                                               /* resolveBatch() only keeps names of up to NAME_MAX characters */
+
+    if(openFile(conn) == -1){
+        logMessage("File %s not found. Sending error message to %s: %s\n", conn->fileName, conn->hostName, conn->portNum);
+        countMetric(&conn->control.owner->metrics.failures[FAILURE_FILE], 1);
+        return appendFrame(&conn->transfer.head, OP_ERROR, ERROR_FILE, 0, conn->fileName, strlen(conn->fileName)) == -1 ? -1 : 1;
+    }
+
+    return announceFile(conn, conn->transfer.fileEnd) == -1 ? -1 : 1;
+}
+
+/****************************************************************
+* Name: createUpload()
+* Description: This function receives a connection as an argument and creates the file its upload is written into. The file is created
+*               with O_TMPFILE, so it has no name until the upload has completed and is never seen half-written, not even after a
+*               crash. File systems without O_TMPFILE get a hidden temporary name instead. The announced size is reserved with
+*               fallocate(), so the file is laid out in one piece and a full disk is found before any contents are received. This
+*               function will return 0 if successful, or -1 with errno set otherwise.
+* Resources used: http://man7.org/linux/man-pages/man2/open.2.html
+*                   http://man7.org/linux/man-pages/man2/fallocate.2.html
+****************************************************************/
+int createUpload(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+
+    xfer->uploading = 1;
+    xfer->tempNamed = 0;
+    xfer->fileFD = open(".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+    if(xfer->fileFD == -1){
+        xfer->tempNamed = 1;
+        strcpy(xfer->tempName, UPLOAD_PREFIX "XXXXXX");
+        xfer->fileFD = mkostemp(xfer->tempName, O_CLOEXEC);
+        if(xfer->fileFD == -1){
+            xfer->tempName[0] = '\0';
+            return -1;
+        }
+        fchmod(xfer->fileFD, 0644);                                             /* mkostemp() creates the file readable by its owner only */
+    }
+
+    if(conn->uploadSize > 0 && fallocate(xfer->fileFD, 0, 0, (off_t)conn->uploadSize) == -1 && errno != EOPNOTSUPP){
+        return -1;
+    }
+
+    xfer->fileOffset = 0;
+    xfer->fileEnd = (off_t)conn->uploadSize;
+    xfer->mode = transferMode == MODE_COPY ? MODE_COPY : MODE_SPLICE;           /* sendfile() cannot write to a file from a socket */
+    xfer->startedNs = currentTimeNs();
+    xfer->checksumming = conn->verify;
+    xfer->syncedTo = 0;
+    xfer->endReceived = 0;
+
+    return 0;
+}
+
+/****************************************************************
+* Name: commitUpload()
+* Description: This function receives a connection as an argument once all of its upload has been written and gives the file its name.
+*               An O_TMPFILE file is first linked under a hidden temporary name, and rename() then moves the file over the name in
+*               one step, so clients downloading the file see either the old or the new version.
+* Resources used: http://man7.org/linux/man-pages/man2/linkat.2.html
+*                   http://man7.org/linux/man-pages/man2/rename.2.html
+****************************************************************/
+int commitUpload(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    unsigned int seed = (unsigned int)currentTimeNs();
+    int attempt = 0;
+
+    for(attempt = 0; !xfer->tempNamed && attempt < 16; attempt++){
+        char procPath[64];
+
+        snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", xfer->fileFD);
+        snprintf(xfer->tempName, sizeof(xfer->tempName), UPLOAD_PREFIX "%08x", (unsigned int)rand_r(&seed));
+        if(linkat(AT_FDCWD, procPath, AT_FDCWD, xfer->tempName, AT_SYMLINK_FOLLOW) == 0){
+            xfer->tempNamed = 1;
+        }
+        else if(errno != EEXIST){
+            break;
+        }
+    }
+    if(!xfer->tempNamed){
+        xfer->tempName[0] = '\0';
+        return -1;
+    }
+
+    if(rename(xfer->tempName, conn->fileName) == -1){
+        return -1;
+    }
+    xfer->tempName[0] = '\0';
+
+    return 0;
+}
+
+/****************************************************************
+* Name: failUpload()
+* Description: This function receives a connection, whether all of its upload has been received and a message as arguments. The file is
+*               discarded and client is told with an error frame. If client has sent everything, the connection waits for the next
+*               request; otherwise the rest of the contents cannot be told apart from the next request, so the connection is closed.
+****************************************************************/
+void failUpload(struct connection *conn, int received, const char *message){
+    logMessage("Upload of %s from %s failed: %s\n", conn->fileName, conn->hostName, message);
+    discardUpload(&conn->transfer);
+    conn->transfer.startedNs = 0;
+
+    if(received){
+        finishTransfer(conn);
+        rejectRequest(conn, ERROR_UPLOAD, message);
+        return;
+    }
+    if(conn->data.fd != -1){                                                    /* Stop reading the TCP data connection while the error is sent */
+        close(conn->data.fd);
+        conn->data.fd = -1;
+    }
+    countMetric(&conn->control.owner->metrics.failures[FAILURE_UPLOAD], 1);
+    conn->state = STATE_CLOSING;
+    sendFrame(conn, OP_ERROR, ERROR_UPLOAD, 0, message, strlen(message));
+}
+
+/****************************************************************
+* Name: finishUpload()
+* Description: This function receives a connection as an argument once all of its upload and the end frame that follows it have been
+*               received. The checksum client sent is checked, the file is flushed to the disk and named, and client is told with an
+*               end frame on the TCP control connection, whose value holds the size of the file.
+* Resources used: http://man7.org/linux/man-pages/man2/fdatasync.2.html
+****************************************************************/
+void finishUpload(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct frameHeader header;
+
+    decodeFrameHeader(xfer->endFrame, &header);
+    if(header.version != PROTOCOL_VERSION || header.opcode != OP_END){
+        failUpload(conn, 1, "Invalid end frame.");
+        return;
+    }
+    if(xfer->checksumming && (header.flags & FLAG_CHECKSUM) && header.value != xfer->checksum){
+        failUpload(conn, 1, "Checksum mismatch: the file contents that arrived are not the ones client sent.");
+        return;
+    }
+    if(fdatasync(xfer->fileFD) == -1 || commitUpload(conn) == -1){
+        failUpload(conn, 1, strerror(errno));
+        return;
+    }
+
+    logMessage("Received %s from %s: %s\n", conn->fileName, conn->hostName, conn->portNum);
+    countMetric(&conn->control.owner->metrics.uploads, 1);
+    close(xfer->fileFD);
+    xfer->fileFD = -1;
+    xfer->uploading = 0;
+    xfer->checksumming = 0;
+    xfer->startedNs = 0;                                                        /* Only files sent are timed */
+
+    if(sendFrame(conn, OP_END, 0, conn->uploadSize, NULL, 0) == -1){
+        return;
+    }
+    finishTransfer(conn);
+}
+
+/****************************************************************
+* Name: uploadAllowance()
+* Description: This function receives a transfer as an argument and returns how many more bytes its upload may receive now without
+*               going over the upload rate set with -R, allowing a burst of one chunk.
+****************************************************************/
+off_t uploadAllowance(struct transfer *xfer){
+    double allowed = (double)uploadRate * (currentTimeNs() - xfer->startedNs) / 1e9 + SEND_CHUNK_SIZE;
+
+    return allowed > (double)xfer->fileOffset ? (off_t)(allowed - xfer->fileOffset) : 0;
+}
+
+/****************************************************************
+* Name: receiveChunk()
+* Description: This function receives a connection and a number of bytes as arguments and moves up to that many bytes of the upload
+*               from the socket into the file. The splice mode moves them through a pipe without copying them into the server; the
+*               copy mode receives them into a large buffer and writes them with pwrite(). Contents that client sent right behind a
+*               single-connection request are already in the input buffer and are written first. This function will return the number
+*               of bytes written, 0 if client closed the connection and -1 on error or if nothing has arrived (EAGAIN).
+* Resources used: http://man7.org/linux/man-pages/man2/splice.2.html
+****************************************************************/
+ssize_t receiveChunk(struct connection *conn, size_t chunk){
+    struct transfer *xfer = &conn->transfer;
+    off_t start = xfer->fileOffset;
+    ssize_t moved;
+
+    if(xfer->overControl && conn->input.length > 0){
+        moved = conn->input.length < chunk ? conn->input.length : chunk;
+        if(pwrite(xfer->fileFD, conn->input.data, moved, xfer->fileOffset) != moved){
+            return -1;
+        }
+        memmove(conn->input.data, conn->input.data + moved, conn->input.length - moved);
+        conn->input.length -= moved;
+        xfer->fileOffset += moved;
+    }
+    else if(xfer->mode == MODE_SPLICE){
+        if(xfer->pipeFDs[0] == -1){
+            if(pipe2(xfer->pipeFDs, O_NONBLOCK | O_CLOEXEC) == -1){
+                xfer->pipeFDs[0] = xfer->pipeFDs[1] = -1;
+                xfer->mode = MODE_COPY;
+                return receiveChunk(conn, chunk);
+            }
+            fcntl(xfer->pipeFDs[1], F_SETPIPE_SZ, SEND_CHUNK_SIZE);             /* A larger pipe lets each splice() move more pages */
+        }
+        moved = splice(xfer->socketFD, NULL, xfer->pipeFDs[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(moved <= 0){
+            return moved;
+        }
+        xfer->piped = moved;
+        while(xfer->piped > 0){                                                 /* Empty the pipe into the file, which only waits for the page cache */
+            ssize_t written = splice(xfer->pipeFDs[0], NULL, xfer->fileFD, (loff_t *)&xfer->fileOffset, xfer->piped, SPLICE_F_MOVE);
+
+            if(written <= 0){
+                return -1;
+            }
+            xfer->piped -= written;
+        }
+    }
+    else{
+        if(xfer->buffer == NULL){
+            xfer->buffer = malloc(copyBufferSize);
+            if(xfer->buffer == NULL){
+                return -1;
+            }
+        }
+        moved = recv(xfer->socketFD, xfer->buffer, chunk < copyBufferSize ? chunk : copyBufferSize, 0);
+        if(moved <= 0){
+            return moved;
+        }
+        if(pwrite(xfer->fileFD, xfer->buffer, moved, xfer->fileOffset) != moved){
+            return -1;
+        }
+        if(xfer->checksumming){
+            xfer->checksum = updateChecksum(xfer->checksum, (const unsigned char *)xfer->buffer, moved);
+        }
+        xfer->fileOffset += moved;
+        return moved;
+    }
+
+    if(xfer->checksumming && checksumFile(xfer, start, moved) == -1){           /* Read back what was just written, which is still in the page cache */
+        return -1;
+    }
+    return moved;
+}
+
+/****************************************************************
+* Name: receiveUpload()
+* Description: This function receives a connection as an argument and receives its upload until the file and the end frame that
+*               follows it have arrived, the socket has nothing more to read or the connection has used up its budget for this turn.
+*               An upload that has reached the rate set with -R waits on the worker's retry list. Writeback of the file is started
+*               every UPLOAD_SYNC_SIZE bytes, so the disk keeps up with the network.
+* Resources used: http://man7.org/linux/man-pages/man2/sync_file_range.2.html
+****************************************************************/
+void receiveUpload(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    struct worker *owner = conn->control.owner;
+    size_t budget = PUMP_BUDGET;
+    ssize_t received;
+
+    if(xfer->throttled){                                                        /* Resumed from the retry list once the upload may go on */
+        return;
+    }
+
+    while(xfer->fileOffset < xfer->fileEnd){
+        size_t chunk = xfer->fileEnd - xfer->fileOffset < SEND_CHUNK_SIZE ? (size_t)(xfer->fileEnd - xfer->fileOffset) : SEND_CHUNK_SIZE;
+
+        if(budget == 0){                                                        /* Give the other clients of this worker a turn */
+            markReady(conn);
+            return;
+        }
+        if(uploadRate != 0){
+            off_t allowance = uploadAllowance(xfer);
+
+            if(allowance < (off_t)chunk && allowance < UPLOAD_MIN_CHUNK){       /* Wait until a useful amount may be received */
+                xfer->throttled = 1;
+                conn->retryAt = currentTimeMs() + 1 + (long long)(UPLOAD_MIN_CHUNK * 1000.0 / uploadRate);
+                conn->next = owner->retryList;
+                owner->retryList = conn;
+                return;
+            }
+            chunk = (off_t)chunk < allowance ? chunk : (size_t)allowance;
+        }
+
+        received = receiveChunk(conn, chunk);
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){          /* Resume once epoll reports more contents */
+            return;
+        }
+        if(received <= 0){
+            failUpload(conn, 0, received == 0 ? "Connection closed before the upload was complete." : strerror(errno));
+            return;
+        }
+        countMetric(&owner->metrics.receivedBytes, received);
+        budget -= (size_t)received < budget ? (size_t)received : budget;
+
+        if(xfer->fileOffset - xfer->syncedTo >= UPLOAD_SYNC_SIZE){
+            sync_file_range(xfer->fileFD, xfer->syncedTo, xfer->fileOffset - xfer->syncedTo, SYNC_FILE_RANGE_WRITE);
+            xfer->syncedTo = xfer->fileOffset;
+        }
+    }
+
+    while(xfer->endReceived < FRAME_HEADER_SIZE){                               /* Then the end frame, which may hold the checksum */
+        size_t wanted = FRAME_HEADER_SIZE - xfer->endReceived;
+
+        if(xfer->overControl && conn->input.length > 0){
+            received = conn->input.length < wanted ? conn->input.length : wanted;
+            memcpy(xfer->endFrame + xfer->endReceived, conn->input.data, received);
+            memmove(conn->input.data, conn->input.data + received, conn->input.length - received);
+            conn->input.length -= received;
+        }
+        else{
+            received = recv(xfer->socketFD, xfer->endFrame + xfer->endReceived, wanted, 0);
+        }
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(received <= 0){
+            failUpload(conn, 0, "Connection closed before the upload was complete.");
+            return;
+        }
+        xfer->endReceived += received;
+    }
+
+    finishUpload(conn);
+}
+
+/****************************************************************
+* Name: countSent()
+* Description: This function receives a connection and a number of bytes it has just sent as arguments and adds them to its worker's
+*               counters. The first bytes sent for a request also record how long client waited for them.
+****************************************************************/
+void countSent(struct connection *conn, size_t length){
+    struct metrics *metrics = &conn->control.owner->metrics;
+
+    if(conn->requestedNs != 0){
+        recordHistogram(&metrics->firstByte, (currentTimeNs() - conn->requestedNs) / 1000);
+        conn->requestedNs = 0;
+    }
+    countMetric(&metrics->sentBytes, length);
+}
+
+/****************************************************************
+* Name: pumpTransfer()
+* Description: This function receives a connection as an argument and sends the head, the file contents and the tail of its transfer
+*               over the TCP data connection (or, in single-connection mode, the TCP control connection) until either everything has
+*               been sent, the socket cannot accept more data or the connection has used up its budget for this turn. TCP_CORK is
+*               held while the transfer runs so that the head, the file and the tail leave in full-sized segments, and is released
+*               once the tail has been queued. Once the transfer is complete, finishTransfer() is called.
+* Resources used: http://man7.org/linux/man-pages/man7/tcp.7.html
+****************************************************************/
+void pumpTransfer(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    size_t budget = PUMP_BUDGET;
+    ssize_t writtenBytes;
+    int flag = 1;
+
+    if(conn->prefetching){                                                      /* Resumed by finishPrefetches() once the next window of the file is in the page cache */
+        return;
+    }
+
+    if(xfer->overControl && conn->outputSent < conn->output.length && flushReply(conn) != 0){    /* The reply to the request must reach client before the transfer */
+        return;
+    }
+
+    if(xfer->uploading){                                                        /* The transfer runs the other way */
+        receiveUpload(conn);
+        return;
+    }
+
+    if(!xfer->corked){
+        setsockopt(xfer->socketFD, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
+        xfer->corked = 1;
+    }
+
+nextFile:
+    if(xfer->announcing){                                                       /* Compress a sample of the file only once it is in the page cache */
+        if(xfer->fileOffset >= xfer->residentEnd && prefetchWindow(conn)){
+            return;
+        }
+        xfer->announcing = 0;
+        if(finishAnnouncement(conn) == -1){
+            closeConnection(conn);
+            return;
+        }
+    }
+
+    while(xfer->headSent < xfer->head.length){                                  /* Send the directory listing or file frame, if there is one */
+        writtenBytes = send(xfer->socketFD, xfer->head.data + xfer->headSent, xfer->head.length - xfer->headSent, MSG_NOSIGNAL | MSG_MORE);
+        if(writtenBytes < 0){
+            goto sendFailed;
+        }
+        xfer->headSent += writtenBytes;
+        countSent(conn, writtenBytes);
+    }
+
+    if(xfer->walk != NULL && !xfer->walk->finished){                            /* Read the next part of a streaming listing into the head and send it */
+        if(budget == 0){
+            markReady(conn);
+            return;
+        }
+        if(nextRecords(conn) == -1){
+            logMessage("Unable to list the directory for %s: %s\n", conn->hostName, conn->portNum);
+            closeConnection(conn);
+            return;
+        }
+        budget -= LIST_FRAME_COST < budget ? LIST_FRAME_COST : budget;
+        goto nextFile;
+    }
+
+    while(xfer->listing != NULL && xfer->listingSent < xfer->listing->length){  /* Send the directory listing, if there is one */
+        writtenBytes = send(xfer->socketFD, xfer->listing->data + xfer->listingSent, xfer->listing->length - xfer->listingSent, MSG_NOSIGNAL | MSG_MORE);
+        if(writtenBytes < 0){
+            goto sendFailed;
+        }
+        xfer->listingSent += writtenBytes;
+        countSent(conn, writtenBytes);
+    }
+
+    while(xfer->fileFD != -1){                                                  /* Send the file contents, if there is a file */
+        if(budget == 0){                                                        /* Give the other clients of this worker a turn */
+            markReady(conn);
+            return;
+        }
+        if(xfer->fileOffset >= xfer->residentEnd && prefetchWindow(conn)){      /* Wait for the next window of the file to be read from the disk */
+            return;
+        }
+
+        writtenBytes = xfer->compression ? sendCompressedChunk(conn) : sendFileChunk(conn);
+        if(writtenBytes < 0){
+            goto sendFailed;
+        }
+        if(writtenBytes == 0){                                                  /* The whole file has been sent */
+            if((xfer->fileEnd >= 0 && xfer->fileOffset < xfer->fileEnd) || (xfer->checksumming && !checksumCurrent(xfer))){    /* The file shrank or was written while it was being sent, so client cannot receive the size or checksum it was promised */
+                logMessage("File %s changed while it was being sent.\n", conn->fileName);
+                closeConnection(conn);
+                return;
+            }
+            releaseFile(xfer->file);
+            xfer->file = NULL;
+            xfer->fileFD = -1;
+            break;
+        }
+        countSent(conn, writtenBytes);
+        budget -= (size_t)writtenBytes < budget ? (size_t)writtenBytes : budget;
+    }
+
+    if(xfer->checksumming){                                                     /* The whole file has been checksummed, so send the checksum in the end frame */
+        xfer->checksumming = 0;
+        if(xfer->cacheChecksum){
+            storeChecksum(conn->fileName, &xfer->checksumKey, xfer->checksum);
+        }
+        encodeFrameHeader(xfer->tail, OP_END, FLAG_CHECKSUM, 0, xfer->checksum);
+    }
+
+    while(xfer->tailSent < xfer->tailLength){                                   /* Inform client that there is nothing more to send */
+        writtenBytes = send(xfer->socketFD, xfer->tail + xfer->tailSent, xfer->tailLength - xfer->tailSent, MSG_NOSIGNAL);
+        if(writtenBytes < 0){
+            goto sendFailed;
+        }
+        xfer->tailSent += writtenBytes;
+        countSent(conn, writtenBytes);
+    }
+
+    if(conn->batchNext < conn->batch.length){                                   /* Go on with the next file of the batch over the same socket */
+        budget -= BATCH_FILE_COST < budget ? BATCH_FILE_COST : budget;
+        finishFile(conn);
+        if(nextBatchFile(conn) == -1){
+            closeConnection(conn);
+            return;
+        }
+        if(budget == 0){
+            markReady(conn);
+            return;
+        }
+        goto nextFile;
+    }
+
+    finishTransfer(conn);
+    return;
+
+sendFailed:
+    if(errno == EAGAIN || errno == EWOULDBLOCK){                                /* Resume once epoll reports that the socket is writable again */
+        return;
+    }
+    logMessage("Error occurred with sending to %s: %s\n", conn->hostName, conn->portNum);
+    countMetric(&conn->control.owner->metrics.failures[FAILURE_SEND], 1);
+    closeConnection(conn);
+}
+
+/****************************************************************
+* Name: startDataConnection()
+* Description: This function receives a connection as an argument and opens the TCP data connection to client on the port that client
+*               sent. The connection is non-blocking, so the transfer starts once epoll reports that the socket is writable.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+****************************************************************/
+void startDataConnection(struct connection *conn){
+    int status = 0;
+
+    if(conn->dataAddress == NULL){
+        conn->dataAddress = getNewAddressInfo(conn->hostName, conn->portNum);   /* Call the getNewAddressInfo() function and return a pointer to newAddrinfo structure */
+        if(conn->dataAddress == NULL){
+            closeConnection(conn);
+            return;
+        }
+    }
+
+    conn->data.fd = createSocket(conn->dataAddress);                            /* Call the createSocket() function to create a socket and return a socket file descriptor */
+    if(conn->data.fd == -1){
+        closeConnection(conn);
+        return;
+    }
+
+    status = connectToSocket(conn->data.fd, conn->dataAddress);                 /* Call the connectToSocket() function to set up a connection */
+    if(status == -1){
+        failDataConnection(conn);
+        return;
+    }
+
+    conn->transfer.socketFD = conn->data.fd;
+    conn->state = status == 0 ? STATE_SENDING : STATE_CONNECTING;
+    if(watchChannel(conn->control.owner, &conn->data, EPOLLOUT | (conn->transfer.uploading ? EPOLLIN | EPOLLRDHUP : 0)) == -1){
+        closeConnection(conn);
+        return;
+    }
+
+    if(conn->state == STATE_SENDING){
+        pumpTransfer(conn);
+    }
+}
+
+/****************************************************************
+* Name: startTransfer()
+* Description: This function receives a connection as an argument and starts sending its transfer. In single-connection mode the
+*               transfer is sent straight away over the TCP control connection; otherwise, the TCP data connection to client is
+*               opened first.
+****************************************************************/
+void startTransfer(struct connection *conn){
+    if(!conn->transfer.overControl){
+        startDataConnection(conn);
+        return;
+    }
+
+    conn->transfer.socketFD = conn->control.fd;
+    conn->state = STATE_SENDING;
+    pumpTransfer(conn);
+}
+
+/****************************************************************
+* Name: startRequest()
+* Description: This function receives a connection and the kind of request it has received as arguments. It counts the request and
+*               starts the clock for the first byte of its answer. The first request of a connection is timed from accept(), so that
+*               the time client waited includes the time the connection waited for the worker.
+****************************************************************/
+void startRequest(struct connection *conn, int kind){
+    countMetric(&conn->control.owner->metrics.requests[kind], 1);
+    if(conn->requests++ > 0){
+        conn->requestedNs = currentTimeNs();
+    }
+}
+
+/****************************************************************
+* Name: handleRequest()
+* Description: This function receives a connection as an argument and is called once client has sent a complete request, either as
+*               the version 1 sequence of messages (port number, command, host name and, for "-g", the file name) or as a version 2
+*               request frame. This function will assess the request to either send a list of the files in the current directory,
+*               send the contents of a file that matches the file name sent by the client program or send an appropriate error
+*               message. The list or file is sent over the TCP data connection by pumpTransfer(). This function will not return any
+*               values.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+*                   https://www.gnu.org/software/libc/manual/html_node/Directory-Entries.html
+*                   https://www.geeksforgeeks.org/input-output-system-calls-c-create-open-close-read-write/
+****************************************************************/
+void handleRequest(struct connection *conn){
+    struct transfer *xfer = &conn->transfer;
+    off_t fileSize = 0;
+
+    if(strcmp(conn->command, "l") == 0){                                        /* If statement to assess whether the command sent by client was "-l" */
+        startRequest(conn, REQUEST_LIST);
+        if(acceptRequest(conn) == -1){                                          /* Write to client to inform it that the command that was sent was successfully received */
+            return;
+        }
+        logMessage("List directory requested on port %s.\n", conn->portNum);
+        logMessage("Sending directory contents to %s: %s\n", conn->hostName, conn->portNum);
+
+        if(xfer->walk == NULL){                                                 /* A streaming listing ends with its own end frame instead */
+            xfer->listing = getListing(conn->version);                          /* Served from the directory index instead of reading the directory */
+            if(xfer->listing == NULL){
+                logMessage("Unable to list the current directory.\n");
+            }
+            setTail(conn, "EOD");                                               /* Inform client that there are no more file names to send */
+        }
+
+        startTransfer(conn);
+        return;
+    }
+
+    if(strcmp(conn->command, "b") == 0){                                        /* Batch request: send every file of the batch back to back */
+        startRequest(conn, REQUEST_BATCH);
+        logMessage("Batch of %ld files requested on port %s.\n", conn->batchCount, conn->portNum);
+        if(conn->batchCount == 0){
+            rejectRequest(conn, ERROR_FILE, "NO MATCHING FILES");
+            return;
+        }
+        if(acceptRequest(conn) == -1){
+            return;
+        }
+        logMessage("Sending %ld files to %s: %s\n", conn->batchCount, conn->hostName, conn->portNum);
+        if(nextBatchFile(conn) == -1){
+            closeConnection(conn);
+            return;
+        }
+
+        startTransfer(conn);
+        return;
+    }
+
+    if(strcmp(conn->command, "p") == 0){                                        /* Upload: receive the file from client */
+        startRequest(conn, REQUEST_PUT);
+        logMessage("Upload of %s (%llu bytes) requested on port %s.\n", conn->fileName, (unsigned long long)conn->uploadSize, conn->portNum);
+        if(maxUploadSize == 0){
+            rejectRequest(conn, ERROR_COMMAND, "Uploads are disabled on this server.");
+            return;
+        }
+        if(conn->fileName[0] == '\0' || strchr(conn->fileName, '/') != NULL || strcmp(conn->fileName, ".") == 0 || strcmp(conn->fileName, "..") == 0 || strncmp(conn->fileName, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0){
+            rejectRequest(conn, ERROR_REQUEST, "Invalid file name.");
+            return;
+        }
+        if(conn->uploadSize > maxUploadSize){
+            rejectRequest(conn, ERROR_UPLOAD, "File is larger than the server accepts.");
+            return;
+        }
+        if(createUpload(conn) == -1){
+            logMessage("Unable to create %s: %s\n", conn->fileName, strerror(errno));
+            discardUpload(xfer);
+            rejectRequest(conn, ERROR_UPLOAD, errno == ENOSPC ? "Not enough space for the file." : "Unable to create the file.");
+            return;
+        }
+        if(acceptRequest(conn) == -1){
+            return;
+        }
+        logMessage("Receiving %s from %s: %s\n", conn->fileName, conn->hostName, conn->portNum);
+
+        startTransfer(conn);
+        return;
+    }
+
+    if(strcmp(conn->command, "g") != 0){
+        logMessage("Received invalid command.\n");
+        rejectRequest(conn, ERROR_COMMAND, "Invalid command. Please use -l or -g as a command.");    /* Inform client that an invalid command was sent */
+        return;
+    }
+
+    startRequest(conn, REQUEST_GET);
+    logMessage("File %s requested on port %s.\n", conn->fileName, conn->portNum);
+
+    openFile(conn);
+
+    if(xfer->fileFD != -1 && conn->ranged){                                     /* Only send the requested part of the file */
+        if(conn->rangeOffset > (uint64_t)xfer->fileEnd){
+            logMessage("Invalid range requested for %s.\n", conn->fileName);
+            releaseFile(xfer->file);
+            xfer->file = NULL;
+            xfer->fileFD = -1;
+            rejectRequest(conn, ERROR_RANGE, "Requested range is past the end of the file.");
+            return;
+        }
+        fileSize = xfer->fileEnd;
+        xfer->fileOffset = conn->rangeOffset;
+        if(conn->rangeLength != 0 && conn->rangeLength < (uint64_t)xfer->fileEnd - conn->rangeOffset){
+            xfer->fileEnd = conn->rangeOffset + conn->rangeLength;
+        }
+    }
+
+    if(xfer->fileFD == -1){                                                     /* Otherwise, there is not a file in the current directory that matches the file name sent by client */
+        logMessage("File not found. Sending error message to %s: %s\n", conn->hostName, conn->portNum);
+        rejectRequest(conn, ERROR_FILE, "FILE NOT FOUND");                      /* Inform client that the file could not be found */
+        return;
+    }
+
+    logMessage("Sending %s to %s: %s\n", conn->fileName, conn->hostName, conn->portNum);
+
+    if(announceFile(conn, fileSize) == -1){
+        closeConnection(conn);
+        return;
+    }
+    if(acceptRequest(conn) == -1){                                              /* Inform client that server found the file */
+        return;
+    }
+
+    startTransfer(conn);
+}
+
+/****************************************************************
+* Name: isLocalPeer()
+* Description: This function receives a connection as an argument and returns 1 if client runs on the server's host, that is if it
+*               connected from the loopback network or from the address it connected to, and 0 otherwise.
+* Resources used: http://man7.org/linux/man-pages/man2/getpeername.2.html
+****************************************************************/
+int isLocalPeer(struct connection *conn){
+    struct sockaddr_in peer;
+    struct sockaddr_in local;
+    socklen_t peerLength = sizeof(peer);
+    socklen_t localLength = sizeof(local);
+
+    if(getpeername(conn->control.fd, (struct sockaddr *)&peer, &peerLength) == -1 || getsockname(conn->control.fd, (struct sockaddr *)&local, &localLength) == -1){
+        return 0;
+    }
+
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127 || peer.sin_addr.s_addr == local.sin_addr.s_addr;
+}
+
+/****************************************************************
+* Name: handleFrame()
+* Description: This function receives a connection, a version 2 frame header and its payload as arguments. A hello frame is answered
+*               with the server's version. A list or get request carries the data port (2 bytes), the length of the host name
+*               (2 bytes), the host name and the file name, which are stored in the connection before handleRequest() is called. In
+*               single-connection mode the data port and host name are not used and may be left empty. A get request with the range
+*               flag also carries an offset (8 bytes) and a length (8 bytes) between the host name length and the host name. A stat
+*               request has the same layout as a get request and is answered from the directory index with the size of the file, so
+*               that client can split the file into ranges. A batch request carries file names and glob patterns, each followed by
+*               '\0', in place of the file name; they are resolved against the directory index right away. A stats request, which has
+*               no payload, is answered with the server's counters, but only for a client on the server's host. A list request with the
+*               stream flag carries a prefix and a cursor in place of the file name and its value holds the page size; startWalk()
+*               reads them.
+****************************************************************/
+void handleFrame(struct connection *conn, struct frameHeader *header, const char *payload){
+    const unsigned char *fields = (const unsigned char *)payload;
+    size_t fixedLength = 4;
+    size_t hostLength;
+    size_t nameLength;
+    int streaming = header->opcode == OP_LIST && (header->flags & FLAG_STREAM) != 0;
+    int namesFollow = streaming || header->opcode == OP_BATCH;                  /* The host name is followed by options or names instead of one file name */
+
+    if(header->opcode == OP_HELLO){
+        sendFrame(conn, OP_HELLO, 0, PROTOCOL_VERSION, NULL, 0);
+        return;
+    }
+
+    if(header->opcode == OP_STATS){                                             /* Answered straight away with the counters as Prometheus text */
+        struct byteBuffer text = { NULL, 0, 0 };
+
+        startRequest(conn, REQUEST_STATS);
+        if(!isLocalPeer(conn)){
+            logMessage("Refused a stats request from a remote client.\n");
+            rejectRequest(conn, ERROR_COMMAND, "Stats are only sent to clients on the server's host.");
+            return;
+        }
+        if(buildMetrics(&text) == -1){
+            free(text.data);
+            closeConnection(conn);
+            return;
+        }
+        sendFrame(conn, OP_OK, 0, text.length, text.data, text.length);
+        free(text.data);
+        return;
+    }
+
+    if(header->opcode != OP_LIST && header->opcode != OP_GET && header->opcode != OP_STAT && header->opcode != OP_BATCH && header->opcode != OP_PUT){
+        logMessage("Received invalid command.\n");
+        rejectRequest(conn, ERROR_COMMAND, "Invalid command. Please use -l or -g as a command.");
+        return;
+    }
+
+    conn->ranged = header->opcode == OP_GET && (header->flags & FLAG_RANGE) != 0;
+    conn->compressions = header->opcode == OP_GET || header->opcode == OP_BATCH ? header->flags & COMPRESSION_FLAGS : 0;
+    conn->verify = (header->opcode == OP_GET || header->opcode == OP_BATCH || header->opcode == OP_PUT) && (header->flags & FLAG_CHECKSUM) != 0;
+    conn->uploadSize = header->opcode == OP_PUT ? header->value : 0;
+    if(conn->ranged){
+        fixedLength += RANGE_SIZE;
+    }
+
+    hostLength = header->length >= fixedLength ? (size_t)((fields[2] << 8) | fields[3]) : BUFFER_SIZE;
+    nameLength = header->length - fixedLength - hostLength;
+
+    if(hostLength >= BUFFER_SIZE || header->length < fixedLength + hostLength || (!namesFollow && nameLength > NAME_MAX) || memchr(payload + fixedLength, '\0', hostLength + (!namesFollow ? nameLength : 0)) != NULL){
+        logMessage("Received invalid request.\n");
+        rejectRequest(conn, ERROR_REQUEST, "Invalid request.");
+        return;
+    }
+
+    if(conn->ranged){
+        memcpy(&conn->rangeOffset, payload + 4, sizeof(conn->rangeOffset));
+        memcpy(&conn->rangeLength, payload + 4 + sizeof(conn->rangeOffset), sizeof(conn->rangeLength));
+        conn->rangeOffset = be64toh(conn->rangeOffset);
+        conn->rangeLength = be64toh(conn->rangeLength);
+    }
+
+    snprintf(conn->portNum, sizeof(conn->portNum), "%u", (fields[0] << 8) | fields[1]);
+    memcpy(conn->hostName, payload + fixedLength, hostLength);
+    conn->hostName[hostLength] = '\0';
+    strcpy(conn->command, header->opcode == OP_LIST ? "l" : header->opcode == OP_BATCH ? "b" : header->opcode == OP_PUT ? "p" : "g");
+
+    if(header->opcode == OP_BATCH){                                             /* The names stay in the connection until the last file of the batch has been sent */
+        conn->batch.length = 0;
+        conn->batchNext = 0;
+        conn->batchCount = resolveBatch(&conn->batch, payload + fixedLength + hostLength, nameLength);
+        if(conn->batchCount == -1){
+            logMessage("Received invalid batch request.\n");
+            rejectRequest(conn, ERROR_REQUEST, "Invalid request.");
+            return;
+        }
+        nameLength = 0;
+    }
+    if(streaming){                                                              /* Open the directory now, so that an invalid cursor is rejected before the listing starts */
+        if(startWalk(conn, header->flags, header->value, payload + fixedLength + hostLength, nameLength) == -1){
+            logMessage("Received invalid listing request.\n");
+            rejectRequest(conn, ERROR_REQUEST, "Invalid request.");
+            return;
+        }
+        nameLength = 0;
+    }
+    memcpy(conn->fileName, payload + fixedLength + hostLength, nameLength);
+    conn->fileName[nameLength] = '\0';
+
+    if(header->opcode == OP_STAT){                                              /* Nothing is sent on a TCP data connection, so answer straight away */
+        struct fileInfo info;
+
+        startRequest(conn, REQUEST_STAT);
+        logMessage("Size of file %s requested.\n", conn->fileName);
+        if(lookupFile(conn->fileName, &info)){
+            sendFrame(conn, OP_OK, 0, info.size, NULL, 0);
+        }
+        else{
+            rejectRequest(conn, ERROR_FILE, "FILE NOT FOUND");
+        }
+        return;
+    }
+    conn->transfer.overControl = (header->flags & FLAG_SINGLE_CONNECTION) != 0;
+
+    if(conn->transfer.overControl){                                             /* Log the address the TCP control connection came from */
+        struct sockaddr_in peer;
+        socklen_t peerLength = sizeof(peer);
+
+        if(getpeername(conn->control.fd, (struct sockaddr *)&peer, &peerLength) == 0){
+            inet_ntop(AF_INET, &peer.sin_addr, conn->hostName, sizeof(conn->hostName));
+        }
+        strcpy(conn->portNum, "control");
+    }
+
+    logMessage("Connection from %s.\n", conn->hostName);
+
+    handleRequest(conn);
+}
+
+/****************************************************************
+* Name: readFrames()
+* Description: This function receives a connection as an argument and reads version 2 frames from the TCP control connection. Bytes
+*               are collected in the connection's input buffer until a whole frame has arrived, so frames do not depend on how the
+*               stream is split into recv() calls. Each complete frame is passed to handleFrame().
+****************************************************************/
+void readFrames(struct connection *conn){
+    while(!conn->closed && conn->state == STATE_REQUEST){
+        struct frameHeader header;
+        ssize_t charsRead;
+
+        if(conn->input.length >= FRAME_HEADER_SIZE){
+            decodeFrameHeader(conn->input.data, &header);
+
+            if(header.version != PROTOCOL_VERSION || header.length > (header.opcode == OP_BATCH ? MAX_BATCH_SIZE : MAX_REQUEST_SIZE)){
+                logMessage("Received invalid frame.\n");
+                rejectRequest(conn, ERROR_REQUEST, "Invalid frame.");
+                return;
+            }
+
+            if(conn->input.length >= FRAME_HEADER_SIZE + header.length){        /* The whole frame has arrived */
+                size_t frameLength = FRAME_HEADER_SIZE + header.length;
+
+                char requestPayload[MAX_REQUEST_SIZE];
+                char *payload = header.length <= MAX_REQUEST_SIZE ? requestPayload : malloc(header.length);    /* Only batch requests are larger */
+
+                if(payload == NULL){
+                    closeConnection(conn);
+                    return;
+                }
+                memcpy(payload, conn->input.data + FRAME_HEADER_SIZE, header.length);    /* Remove the frame from the input before it is handled */
+                memmove(conn->input.data, conn->input.data + frameLength, conn->input.length - frameLength);
+                conn->input.length -= frameLength;
+
+                handleFrame(conn, &header, payload);
+                if(payload != requestPayload){
+                    free(payload);
+                }
+                continue;
+            }
+        }
+
+        if(reserveBytes(&conn->input, MAX_REQUEST_SIZE) == -1){
+            closeConnection(conn);
+            return;
+        }
+
+        charsRead = recv(conn->control.fd, conn->input.data + conn->input.length, conn->input.capacity - conn->input.length, 0);
+
+        if(charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){         /* Nothing more to read until client sends its next frame */
+            return;
+        }
+        if(charsRead <= 0){                                                     /* Client closed the TCP control connection or an error occurred */
+            closeConnection(conn);
+            return;
+        }
+        conn->input.length += charsRead;
+    }
+}
+
+/****************************************************************
+* Name: handleControl()
+* Description: This function receives a connection as an argument and is called when epoll reports activity on the TCP control
+*               connection. It runs the control connection state machine. The first message tells the two protocol versions apart:
+*               version 1 clients send the port number in ASCII, while version 2 clients send a hello frame, whose first byte is the
+*               version number. For version 1, each message that client sends is stored in the field for the current state (port
+*               number, command, host name, then file name) and is acknowledged the same way as before, after which handleRequest()
+*               is called to act on the command. Version 2 frames are handled by readFrames().
+****************************************************************/
+void handleControl(struct connection *conn, unsigned int events){
+    char *noError = "NE";
+    char *noCommandError = "NCE";
+
+    if(conn->state == STATE_SENDING && conn->transfer.overControl){             /* In single-connection mode, the transfer is sent when the TCP control connection is writable */
+        pumpTransfer(conn);
+        return;
+    }
+
+    if(conn->outputSent < conn->output.length && flushReply(conn) != 0){        /* Finish sending the previous control message first */
+        return;
+    }
+
+    while(conn->state <= STATE_FILENAME){
+        char *field;
+        ssize_t charsRead;
+
+        switch(conn->state){
+            case STATE_PORT:    field = conn->portNum;  break;
+            case STATE_COMMAND: field = conn->command;  break;
+            case STATE_HOST:    field = conn->hostName; break;
+            default:            field = conn->fileName; break;
+        }
+
+        memset(field, 0, BUFFER_SIZE);                                          /* Ensure that the field is empty */
+        charsRead = recv(conn->control.fd, field, BUFFER_SIZE - 1, 0);          /* Read data from the socket */
+
+        if(charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){         /* Nothing more to read until client sends its next message */
+            return;
+        }
+        if(charsRead <= 0){                                                     /* Client closed the TCP control connection or an error occurred */
+            closeConnection(conn);
+            return;
+        }
+
+        if(conn->state == STATE_PORT && (unsigned char)field[0] == PROTOCOL_VERSION){    /* A hello frame, so switch to version 2 */
+            conn->version = PROTOCOL_VERSION;
+            conn->state = STATE_REQUEST;
+            if(appendBytes(&conn->input, field, charsRead) == -1){
+                closeConnection(conn);
+                return;
+            }
+            memset(conn->portNum, 0, sizeof(conn->portNum));
+        }
+        else if(conn->state == STATE_PORT || conn->state == STATE_COMMAND){
+            conn->state++;
+            if(sendReply(conn, noError) != 0){                                  /* Write to client to inform it that no errors have occurred thus far */
+                return;
+            }
+        }
+        else if(conn->state == STATE_HOST && strcmp(conn->command, "g") == 0){ /* The file name follows the "-g" command */
+            logMessage("Connection from %s.\n", conn->hostName);
+            conn->state = STATE_FILENAME;
+            if(sendReply(conn, noCommandError) != 0){                           /* Write to client to inform it that the command that was sent was successfully received */
+                return;
+            }
+        }
+        else{
+            if(conn->state == STATE_HOST){
+                logMessage("Connection from %s.\n", conn->hostName);
+            }
+            handleRequest(conn);
+        }
+    }
+
+    if(conn->state == STATE_REQUEST){
+        readFrames(conn);
+    }
+
+    if(!conn->closed && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && conn->state == STATE_CLOSING){
+        closeConnection(conn);
+    }
+}
+
+/****************************************************************
+* Name: handleData()
+* Description: This function receives a connection as an argument and is called when epoll reports that the TCP data connection is
+*               writable. If the connection was still being opened, its result is checked first; then the transfer continues.
+* Resources used: http://man7.org/linux/man-pages/man2/connect.2.html
+****************************************************************/
+void handleData(struct connection *conn, unsigned int events){
+    if(conn->state == STATE_CONNECTING){
+        int socketError = 0;
+        socklen_t length = sizeof(socketError);
+
+        if(getsockopt(conn->data.fd, SOL_SOCKET, SO_ERROR, &socketError, &length) == -1 || socketError != 0){
+            failDataConnection(conn);                                           /* Client is most likely not listening yet, so try again shortly */
+            return;
+        }
+        conn->state = STATE_SENDING;
+    }
+
+    if(conn->state == STATE_SENDING && (events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP))){
+        pumpTransfer(conn);
+    }
+}
+
+/****************************************************************
+* Name: acceptConnections()
+* Description: This function receives a worker as an argument and accepts every pending connection on the worker's listening socket.
+*               Each new TCP control connection is made non-blocking and registered with the worker's epoll instance.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+*                   http://man7.org/linux/man-pages/man2/accept.2.html
+****************************************************************/
+void acceptConnections(struct worker *owner){
+    int enable = 1;
+
+    while(1){
+        struct sockaddr_storage their_addr;
+        socklen_t addr_size = sizeof(their_addr);
+        struct connection *conn;
+        int new_socketFD = accept4(owner->listener.fd, (struct sockaddr *)&their_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(new_socketFD == -1){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            return;                                                             /* EAGAIN means there are no more pending connections */
+        }
+
+        conn = calloc(1, sizeof(struct connection));
+        if(conn == NULL){
+            close(new_socketFD);
+            continue;
+        }
+        setsockopt(new_socketFD, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));    /* Replies are whole messages, so Nagle's algorithm would only hold a small transfer back until client acknowledges the reply before it */
+
+        conn->control.fd = new_socketFD;
+        conn->control.kind = CHANNEL_CONTROL;
+        conn->control.conn = conn;
+        conn->control.owner = owner;
+        conn->data.fd = -1;
+        conn->data.kind = CHANNEL_DATA;
+        conn->data.conn = conn;
+        conn->data.owner = owner;
+        conn->transfer.socketFD = -1;
+        conn->transfer.fileFD = -1;
+        conn->transfer.fileEnd = -1;
+        conn->transfer.pipeFDs[0] = conn->transfer.pipeFDs[1] = -1;
+        conn->state = STATE_PORT;
+        conn->version = 1;
+        conn->requestedNs = currentTimeNs();                                    /* The first request is timed from here */
+        countMetric(&owner->metrics.connections, 1);
+
+        if(watchChannel(owner, &conn->control, EPOLLIN | EPOLLOUT | EPOLLRDHUP) == -1){
+            close(new_socketFD);
+            free(conn);
+            continue;
+        }
+
+        handleControl(conn, 0);                                                 /* Client may have already sent its first message */
+    }
+}
+
+/****************************************************************
+* Name: runWorker()
+* Description: This function is the entry point of each worker thread. It waits on the worker's epoll instance and dispatches each
+*               event to the listening socket, a TCP control connection, a TCP data connection or the eventfd that reports completed
+*               prefetches. It also retries TCP data connections that could not be opened and frees the connections that were closed
+*               while handling a batch of events.
+* Resources used: http://man7.org/linux/man-pages/man7/epoll.7.html
+****************************************************************/
+void *runWorker(void *arg){
+    struct worker *owner = arg;
+    struct epoll_event events[MAX_EVENTS];
+    sigset_t waitMask;
+
+    pthread_sigmask(SIG_SETMASK, NULL, &waitMask);
+    sigdelset(&waitMask, SIGUSR1);
+
+    while(1){
+        int timeout = owner->readyList != NULL ? 0 : owner->retryList != NULL ? CONNECT_RETRY_MS : -1;
+        int eventCount = epoll_pwait(owner->epollFD, events, MAX_EVENTS, timeout, &waitMask);    /* SIGUSR1 is only delivered while waiting */
+        int i = 0;
+
+        if(eventCount == -1 && errno != EINTR){
+            error("Error waiting for events.\n");
+        }
+        if(reportRequested){
+            reportRequested = 0;
+            reportCache();
+        }
+
+        for(i = 0; i < eventCount; i++){
+            struct channel *chan = events[i].data.ptr;
+
+            if(chan->kind == CHANNEL_LISTEN){
+                acceptConnections(owner);
+            }
+            else if(chan->kind == CHANNEL_WAKE){
+                finishPrefetches(owner);
+            }
+            else if(chan->conn->closed){                                        /* The connection was closed by an earlier event in this batch */
+                continue;
+            }
+            else if(chan->kind == CHANNEL_CONTROL){
+                handleControl(chan->conn, events[i].events);
+            }
+            else{
+                handleData(chan->conn, events[i].events);
+            }
+        }
+
+        if(owner->retryList != NULL){                                           /* Retry the TCP data connections that are due */
+            long long now = currentTimeMs();
+            struct connection **link = &owner->retryList;
+
+            while(*link != NULL){
+                struct connection *conn = *link;
+
+                if(conn->retryAt > now){
+                    link = &conn->next;
+                    continue;
+                }
+                *link = conn->next;
+                conn->next = NULL;
+                if(conn->transfer.throttled){                                   /* An upload that waited for its rate limit */
+                    conn->transfer.throttled = 0;
+                    pumpTransfer(conn);
+                }
+                else{
+                    startDataConnection(conn);
+                }
+            }
+        }
+
+        if(owner->readyList != NULL){                                           /* Resume the transfers that used up their budget and the connections waiting for a request */
+            struct connection *conn = owner->readyList;
+
+            owner->readyList = NULL;
+            while(conn != NULL){
+                struct connection *readyNext = conn->readyNext;
+
+                conn->ready = 0;
+                if(!conn->closed && conn->state == STATE_SENDING){
+                    pumpTransfer(conn);
+                }
+                else if(!conn->closed && conn->state == STATE_REQUEST){
+                    readFrames(conn);
+                }
+                conn = readyNext;
+            }
+        }
+
+        while(owner->closedList != NULL){                                       /* Free the connections closed during this batch */
+            struct connection *conn = owner->closedList;
+
+            owner->closedList = conn->next;
+            free(conn);
+        }
+
+#ifdef USE_IO_URING
+        submitRing(owner);                                                      /* Submit the reads queued during this batch in one system call */
+#endif
+    }
+
+    return NULL;
+}
+
+/****************************************************************
+* Name: createListener()
+* Description: This function receives a worker and the server port number as arguments. It creates the worker's epoll instance and a
+*               listening socket bound with SO_REUSEPORT, so every worker has its own accept queue on the same port and the kernel
+*               spreads incoming connections across the workers.
+* Resources used: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo
+*                   http://man7.org/linux/man-pages/man7/socket.7.html
+****************************************************************/
+void createListener(struct worker *owner, char *portNum){
+    int status = 0;
+    int enable = 1;
+    struct addrinfo *addInfo = getAddressInfo(portNum);                         /* Call the getAddressInfo() function and return a pointer to addrinfo structure */
+
+    owner->listener.fd = createSocket(addInfo);                                 /* Call the createSocket() function to create a socket and return a socket file descriptor */
+    owner->listener.kind = CHANNEL_LISTEN;
+    owner->listener.owner = owner;
+
+    if(owner->listener.fd == -1){
+        error("Error in creating socket.\n");
+    }
+
+    setsockopt(owner->listener.fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if(setsockopt(owner->listener.fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1){
+        error("Error in setting SO_REUSEPORT.\n");
+    }
+
+    status = bind(owner->listener.fd, addInfo->ai_addr, addInfo->ai_addrlen);   /* Call bind() method to bind socket to host the server is running on. I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+
+    if(status == -1){                                                           /* Close the socket, print out an error message and exit if the call to the bind() function was unsuccessful */
+        close(owner->listener.fd);
+        error("Error in binding socket to port.\n");
+    }
+
+    freeaddrinfo(addInfo);                                                      /* Free the linked list allocated by getaddrinfo(). I utilized Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+
+    status = listen(owner->listener.fd, SOMAXCONN);                             /* Call listen() method to listen to incoming connections on the specified port, with the largest incoming queue allowed */
+
+    if(status == -1){                                                           /* Close the socket, print out an error message and exit if the call to the listen() function was unsuccessful */
+        close(owner->listener.fd);
+        error("Error in listening on bound socket.\n");
+    }
+
+    owner->epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if(owner->epollFD == -1){
+        error("Error in creating epoll instance.\n");
+    }
+
+    if(watchChannel(owner, &owner->listener, EPOLLIN) == -1){
+        error("Error in watching listening socket.\n");
+    }
+}
+
+/* Please note, I referenced Beej's Guide: https://beej.us/guide/bgnet/html/multi/syscalls.html#getaddrinfo */
+int main(int argc, char *argv[]){
+    int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);                       /* By default, run one worker thread per core */
+    int option = 0;
+    int i = 0;
+    int needPrefetchers = 0;
+    struct worker *workers;
+    pthread_t loggerThread;
+    sigset_t blocked;
+
+    while((option = getopt(argc, argv, "t:m:B:F:M:P:U:R:")) != -1){             /* Read the optional arguments. I utilized: http://man7.org/linux/man-pages/man3/getopt.3.html */
+        switch(option){
+            case 't':
+                threadCount = atoi(optarg);                                     /* Number of worker threads */
+                break;
+            case 'm':                                                           /* How files are sent: sendfile (default), splice or copy */
+                if(strcmp(optarg, "sendfile") == 0){
+                    transferMode = MODE_SENDFILE;
+                }
+                else if(strcmp(optarg, "splice") == 0){
+                    transferMode = MODE_SPLICE;
+                }
+                else if(strcmp(optarg, "copy") == 0){
+                    transferMode = MODE_COPY;
+                }
+                else{
+                    error("Unknown transfer mode. Please use sendfile, splice or copy.\n");
+                }
+                break;
+            case 'B':
+                copyBufferSize = (size_t)atol(optarg);                          /* Size of the buffer used by the copy mode */
+                if(copyBufferSize == 0){
+                    error("Erroneous buffer size.\n");
+                }
+                break;
+            case 'F':
+                fileCache.slotCount = (size_t)atol(optarg);                     /* Number of files the hot-file cache keeps open */
+                if(fileCache.slotCount == 0){
+                    error("Erroneous number of cached files.\n");
+                }
+                break;
+            case 'M':
+                fileCache.mapBudget = (size_t)atol(optarg) << 20;               /* Megabytes of files the hot-file cache may map, 0 to never map */
+                break;
+            case 'P':
+                prefetchThreads = atoi(optarg);                                 /* Threads that read cold files, 0 to read them in the workers */
+                if(prefetchThreads < 0){
+                    error("Erroneous number of prefetch threads.\n");
+                }
+                break;
+            case 'U':
+                maxUploadSize = strtoull(optarg, NULL, 10) << 20;               /* Megabytes a single upload may hold, 0 to refuse uploads */
+                break;
+            case 'R':
+                uploadRate = strtoull(optarg, NULL, 10) << 20;                  /* Megabytes per second each upload may use, 0 for no limit */
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-m sendfile|splice|copy] [-B copy buffer bytes] [-F cached files] [-M cached megabytes] [-P prefetch threads] [-U upload megabytes] [-R upload megabytes per second] <port #>\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 1){                                                    /* Verify if the correct number of arguments were used. There should be 1 argument after the options, which is the port # */
+        error("Incorrect number of arguments.\n");
+    }
+
+    if(threadCount < 1){
+        threadCount = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);                                                   /* A client that disconnects mid-transfer must not terminate the server */
+
+    fileCache.bucketCount = 1;
+    while(fileCache.bucketCount < fileCache.slotCount){                         /* About one cached file per bucket */
+        fileCache.bucketCount *= 2;
+    }
+    fileCache.slots = calloc(fileCache.slotCount, sizeof(struct cachedFile *));
+    fileCache.buckets = calloc(fileCache.bucketCount, sizeof(struct cachedFile *));
+    if(fileCache.slots == NULL || fileCache.buckets == NULL){
+        error("Error allocating the file cache.\n");
+    }
+    signal(SIGUSR1, requestReport);
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);                                 /* Every thread started from here blocks SIGUSR1, and the workers only accept it in epoll_pwait() */
+
+    if(pthread_create(&loggerThread, NULL, runLogger, NULL) != 0){
+        error("Error creating logger thread.\n");
+    }
+    pthread_detach(loggerThread);
+    logMessage("Server open on %s\n", argv[optind]);
+
+    startChecksums();
+    startDirectoryIndex();                                                      /* Build the directory index before any request can arrive */
+
+    if(posix_memalign((void **)&workers, __alignof__(struct worker), threadCount * sizeof(struct worker)) != 0){    /* Aligned, so that the counters of each worker have their own cache lines */
+        error("Error allocating workers.\n");
+    }
+    memset(workers, 0, threadCount * sizeof(struct worker));
+    workerList = workers;
+    workerCount = threadCount;
+
+    for(i = 0; i < threadCount; i++){                                           /* Bind every listening socket before any worker starts, so errors are reported up front */
+        workers[i].id = i;
+        createListener(&workers[i], argv[optind]);
+        needPrefetchers |= startPrefetching(&workers[i]);
+    }
+
+    for(i = 0; needPrefetchers && i < prefetchThreads; i++){
+        pthread_t thread;
+
+        if(pthread_create(&thread, NULL, runPrefetcher, NULL) != 0){
+            error("Error creating prefetch thread.\n");
+        }
+        pthread_detach(thread);
+    }
+
+    for(i = 0; i < threadCount; i++){
+        if(pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0){
+            error("Error creating worker thread.\n");
+        }
+    }
+
+    for(i = 0; i < threadCount; i++){                                           /* The workers accept new connections until terminated by a user via SIGINT */
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
 
     return 0;
 }